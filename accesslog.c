@@ -0,0 +1,225 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * Requests held before being written out.
+ * Beyond this, requests are counted as dropped.
+ */
+#define	ACCESSLOG_RING	256
+
+/*
+ * Longest line written: longer ones are dropped.
+ */
+#define	ACCESSLOG_LINE	384
+
+/*
+ * How often (seconds) held requests are written out even if there are
+ * few of them.
+ */
+#define	ACCESSLOG_INTERVAL 1
+
+/*
+ * Requests are held in a ring and written out together, one JSON object
+ * per line, between requests: see accesslog_tick().
+ */
+struct	accesslog {
+	int		  fd;
+	const char *const *names; /* page names */
+	size_t		  namesz;
+	struct accessent  ring[ACCESSLOG_RING];
+	size_t		  first; /* oldest held */
+	size_t		  count; /* number held */
+	uint64_t	  dropped; /* not yet reported */
+	time_t		  last; /* monotonic seconds of last write */
+	char		  buf[(ACCESSLOG_RING + 1) * ACCESSLOG_LINE];
+};
+
+static time_t
+accesslog_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Append the file "file", naming pages with the "namesz" names in
+ * "names" and any others "other".
+ * This must be opened before giving up the right to open files.
+ * Returns NULL on failure.
+ */
+struct accesslog *
+accesslog_alloc(const char *file, const char *const *names, size_t namesz)
+{
+	struct accesslog *l;
+
+	if (NULL == (l = calloc(1, sizeof(struct accesslog))))
+		return NULL;
+	l->fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (-1 == l->fd) {
+		kutil_warn(NULL, NULL, "%s", file);
+		free(l);
+		return NULL;
+	}
+	l->names = names;
+	l->namesz = namesz;
+	l->last = accesslog_now();
+	return l;
+}
+
+/*
+ * Hold a request to be written.
+ * This never writes, so it never blocks.
+ */
+void
+accesslog_add(struct accesslog *l, const struct accessent *e)
+{
+
+	if (ACCESSLOG_RING == l->count) {
+		l->dropped++;
+		return;
+	}
+	l->ring[(l->first + l->count++) % ACCESSLOG_RING] = *e;
+}
+
+/*
+ * Format a request into "buf" of size "sz".
+ * Returns the length or zero if it doesn't fit.
+ */
+static size_t
+accesslog_line(const struct accesslog *l,
+	const struct accessent *e, char *buf, size_t sz)
+{
+	size_t	 i, len;
+	int	 c;
+
+	c = snprintf(buf, sz, "{\"time\":%lld,\"page\":\"%s\","
+		"\"method\":\"%s\",\"status\":%ld,\"user\":%" PRId64
+		",\"us\":{", (long long)e->time,
+		e->page < l->namesz ? l->names[e->page] : "other",
+		e->method < KMETHOD__MAX ? kmethods[e->method] : "other",
+		e->code < KHTTP__MAX ? strtol(khttps[e->code], NULL, 10) : 0L,
+		e->userid);
+	if (c < 0 || (size_t)c >= sz)
+		return 0;
+	len = c;
+
+	for (i = 0; i < MPHASE__MAX; i++) {
+		if ( ! (e->phases & (1U << i)))
+			continue;
+		c = snprintf(buf + len, sz - len, "%s\"%s\":%" PRIu32,
+			'{' == buf[len - 1] ? "" : ",", mphases[i], e->us[i]);
+		if (c < 0 || (size_t)c >= sz - len)
+			return 0;
+		len += c;
+	}
+
+	c = snprintf(buf + len, sz - len, "}}\n");
+	if (c < 0 || (size_t)c >= sz - len)
+		return 0;
+	return len + c;
+}
+
+/*
+ * Write out all held requests (and how many have been dropped since
+ * last written) with a single write.
+ * If the write fails, they're counted as dropped.
+ */
+void
+accesslog_flush(struct accesslog *l)
+{
+	size_t	 len = 0, sz;
+	ssize_t	 ssz;
+	uint64_t lost;
+	int	 c;
+
+	l->last = accesslog_now();
+	if (0 == l->count && 0 == l->dropped)
+		return;
+
+	/* Should the write fail, these are lost. */
+
+	lost = l->count;
+	for ( ; l->count > 0; l->count--) {
+		len += accesslog_line(l, &l->ring[l->first],
+			l->buf + len, ACCESSLOG_LINE);
+		l->first = (l->first + 1) % ACCESSLOG_RING;
+	}
+
+	if (l->dropped > 0) {
+		c = snprintf(l->buf + len, ACCESSLOG_LINE,
+			"{\"time\":%lld,\"dropped\":%" PRIu64 "}\n",
+			(long long)time(NULL), l->dropped);
+		if (c > 0 && c < ACCESSLOG_LINE) {
+			len += c;
+			lost += l->dropped;
+			l->dropped = 0;
+		}
+	}
+
+	for (sz = 0; sz < len; sz += ssz)
+		if (-1 == (ssz = write(l->fd, l->buf + sz, len - sz))) {
+			if (EINTR == errno) {
+				ssz = 0;
+				continue;
+			}
+			kutil_warn(NULL, NULL, "accesslog: write");
+			l->dropped += lost;
+			break;
+		}
+}
+
+/*
+ * Called between requests: write out held requests if there are many
+ * or if they've been held a while.
+ */
+void
+accesslog_tick(struct accesslog *l)
+{
+
+	if (l->count >= ACCESSLOG_RING / 2 ||
+	    accesslog_now() - l->last >= ACCESSLOG_INTERVAL)
+		accesslog_flush(l);
+}
+
+void
+accesslog_free(struct accesslog *l)
+{
+
+	if (NULL == l)
+		return;
+	accesslog_flush(l);
+	close(l->fd);
+	free(l);
+}
@@ -0,0 +1,152 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * Size of the first block, which holds a typical request.
+ */
+#define	ARENA_BLOCK	4096
+
+/*
+ * Everything allocated is aligned to this.
+ */
+#define	ARENA_ALIGN	16
+
+/*
+ * A block of memory handed out from its start.
+ * Blocks are chained newest first.
+ */
+struct	ablock {
+	struct ablock	*next;
+	size_t		 size;
+	size_t		 used;
+	char		 data[];
+};
+
+/*
+ * Allocate "sz" bytes good until the next arena_reset(), or NULL on
+ * memory exhaustion.
+ */
+void *
+arena_malloc(struct arena *a, size_t sz)
+{
+	struct ablock	*b;
+	size_t		 bsz;
+	void		*p;
+
+	if (sz > SIZE_MAX - ARENA_ALIGN - sizeof(struct ablock))
+		return NULL;
+	sz = (sz + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (NULL == (b = a->head) || b->size - b->used < sz) {
+		bsz = a->size > 0 ? a->size : ARENA_BLOCK;
+		if (bsz < sz)
+			bsz = sz;
+		if (NULL == (b = malloc(sizeof(struct ablock) + bsz)))
+			return NULL;
+		b->next = a->head;
+		b->size = bsz;
+		b->used = 0;
+		a->head = b;
+		a->size = bsz;
+	}
+
+	p = b->data + b->used;
+	b->used += sz;
+	return p;
+}
+
+/*
+ * Copy "sz" bytes of "p" into the arena.
+ */
+void *
+arena_memdup(struct arena *a, const void *p, size_t sz)
+{
+	void	*np;
+
+	if (NULL != (np = arena_malloc(a, sz)))
+		memcpy(np, p, sz);
+	return np;
+}
+
+/*
+ * Like strdup(3), but from the arena.
+ */
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+	size_t	 sz = strlen(s) + 1;
+	char	*p;
+
+	if (NULL != (p = arena_malloc(a, sz)))
+		memcpy(p, s, sz);
+	return p;
+}
+
+/*
+ * Release everything allocated from the arena at once.
+ * If the last request needed more than one block, the blocks are
+ * replaced by one that would have held them all, so that a worker soon
+ * stops allocating at all.
+ */
+void
+arena_reset(struct arena *a)
+{
+	struct ablock	*b;
+	size_t		 sz = 0;
+
+	if (NULL == a->head)
+		return;
+	if (NULL == a->head->next) {
+		a->head->used = 0;
+		return;
+	}
+
+	while (NULL != (b = a->head)) {
+		a->head = b->next;
+		sz += b->size;
+		free(b);
+	}
+	a->size = sz;
+}
+
+/*
+ * Free all of the arena's memory.
+ * It may be used again afterward.
+ */
+void
+arena_free(struct arena *a)
+{
+	struct ablock	*b;
+
+	while (NULL != (b = a->head)) {
+		a->head = b->next;
+		free(b);
+	}
+	a->size = 0;
+}
@@ -0,0 +1,458 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+#include "bench.h"
+
+/*
+ * Load generator for the JSON pages, run by "make bench".
+ * Each client process logs in as its own user, asks for its user
+ * information, changes its e-mail address, and logs out, over and
+ * over, either running the CGI script for each request or speaking
+ * FastCGI to a server that we start.
+ * The database is reset and seeded with one user per client first.
+ */
+
+/*
+ * Sessions opened for check_sessions().
+ */
+#define	CHECK_SESSIONS	3
+
+enum	route {
+	ROUTE_LOGIN,
+	ROUTE_INDEX,
+	ROUTE_MODEMAIL,
+	ROUTE_LOGOUT,
+	ROUTE__MAX
+};
+
+static	const char *const routes[ROUTE__MAX] = {
+	"login", /* ROUTE_LOGIN */
+	"index", /* ROUTE_INDEX */
+	"usermodemail", /* ROUTE_MODEMAIL */
+	"logout", /* ROUTE_LOGOUT */
+};
+
+/*
+ * A timed request, written by clients into shared memory.
+ */
+struct	sample {
+	uint32_t	 us; /* latency (microseconds) */
+	uint8_t		 route; /* enum route */
+	uint8_t		 ok; /* answered with 200 */
+};
+
+struct	bopts {
+	const char	*cgi; /* -C */
+	const char	*sock; /* -S with -F */
+	size_t		 clients; /* -c */
+	size_t		 sessions; /* -n */
+	size_t		 index; /* -i */
+	size_t		 mods; /* -m */
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Send one request and record it in "s".
+ * Returns the status code.
+ */
+static int
+run(const struct bopts *o, enum route rt, const struct breq *q,
+	struct sample *s, char *tok, size_t sz)
+{
+	struct buf	 out;
+	uint64_t	 start;
+	int		 status;
+
+	memset(&out, 0, sizeof(struct buf));
+	start = now_us();
+	if (NULL != o->cgi)
+		cgi_send(o->cgi, q, &out, NULL);
+	else
+		fcgi_send(o->sock, q, &out);
+	s->us = now_us() - start;
+	status = resp_parse(&out, tok, sz);
+	s->route = rt;
+	s->ok = 200 == status;
+	free(out.p);
+	return status;
+}
+
+/*
+ * Log the first client in CHECK_SESSIONS times, then check that
+ * sessions.json lists all of those sessions and says it's complete, as
+ * the list is streamed (say, through the broker with -D) and a lost row
+ * would otherwise go unnoticed.
+ * The sessions are left to expire.
+ * Returns zero on failure.
+ */
+static int
+check_sessions(const struct bopts *o)
+{
+	struct breq	 q;
+	struct buf	 out;
+	const char	*cp;
+	char		 tok[64];
+	size_t		 i, found = 0;
+	int		 status, ok = 0;
+
+	for (i = 0; i < CHECK_SESSIONS; i++) {
+		memset(&q, 0, sizeof(struct breq));
+		memset(&out, 0, sizeof(struct buf));
+		q.method = "POST";
+		q.page = routes[ROUTE_LOGIN];
+		form_add(q.body, sizeof(q.body),
+			valid_keys[VALID_USER_EMAIL].name,
+			"bench0@example.com");
+		form_add(q.body, sizeof(q.body),
+			valid_keys[VALID_USER_HASH].name, BENCH_PASS);
+		if (NULL != o->cgi)
+			cgi_send(o->cgi, &q, &out, NULL);
+		else
+			fcgi_send(o->sock, &q, &out);
+		tok[0] = '\0';
+		status = resp_parse(&out, tok, sizeof(tok));
+		free(out.p);
+		if (200 != status || '\0' == tok[0]) {
+			warnx("check: login failed");
+			return 0;
+		}
+	}
+
+	memset(&q, 0, sizeof(struct breq));
+	memset(&out, 0, sizeof(struct buf));
+	q.method = "GET";
+	q.page = "sessions";
+	snprintf(q.cookie, sizeof(q.cookie), "%s=%s",
+		valid_keys[VALID_SESS_TOKEN].name, tok);
+	if (NULL != o->cgi)
+		cgi_send(o->cgi, &q, &out, NULL);
+	else
+		fcgi_send(o->sock, &q, &out);
+	if (200 != resp_parse(&out, NULL, 0)) {
+		warnx("check: sessions failed");
+		free(out.p);
+		return 0;
+	}
+
+	for (cp = out.p; NULL != (cp = strstr(cp, "\"current\"")); cp++)
+		found++;
+	if (found < CHECK_SESSIONS)
+		warnx("check: %zu of %d sessions listed",
+			found, CHECK_SESSIONS);
+	else if (NULL == (cp = strstr(out.p, "\"complete\"")) ||
+	    NULL == strstr(cp, "true"))
+		warnx("check: session list incomplete");
+	else
+		ok = 1;
+	free(out.p);
+	return ok;
+}
+
+/*
+ * Run client "n" for its share of sessions, writing samples into "s".
+ * Returns the number of samples written.
+ */
+static size_t
+client(const struct bopts *o, size_t n, struct sample *s)
+{
+	struct breq	 q;
+	char		 email[128], tok[64];
+	size_t		 i, j, ns = 0, mods = 0;
+
+	snprintf(email, sizeof(email), "bench%zu@example.com", n);
+
+	for (i = 0; i < o->sessions; i++) {
+		memset(&q, 0, sizeof(struct breq));
+		q.method = "POST";
+		q.page = routes[ROUTE_LOGIN];
+		form_add(q.body, sizeof(q.body),
+			valid_keys[VALID_USER_EMAIL].name, email);
+		form_add(q.body, sizeof(q.body),
+			valid_keys[VALID_USER_HASH].name, BENCH_PASS);
+		tok[0] = '\0';
+		if (200 != run(o, ROUTE_LOGIN, &q,
+		    &s[ns++], tok, sizeof(tok)) || '\0' == tok[0])
+			continue;
+
+		memset(&q, 0, sizeof(struct breq));
+		snprintf(q.cookie, sizeof(q.cookie), "%s=%s",
+			valid_keys[VALID_SESS_TOKEN].name, tok);
+
+		q.method = "GET";
+		q.page = routes[ROUTE_INDEX];
+		for (j = 0; j < o->index; j++)
+			run(o, ROUTE_INDEX, &q, &s[ns++], NULL, 0);
+
+		q.method = "POST";
+		q.page = routes[ROUTE_MODEMAIL];
+		for (j = 0; j < o->mods; j++) {
+			q.body[0] = '\0';
+			snprintf(email, sizeof(email),
+				"bench%zu-%zu@example.com", n, ++mods);
+			form_add(q.body, sizeof(q.body),
+				valid_keys[VALID_USER_EMAIL].name, email);
+			if (200 != run(o, ROUTE_MODEMAIL,
+			    &q, &s[ns++], NULL, 0))
+				errx(EXIT_FAILURE, "client %zu: "
+					"e-mail change failed", n);
+		}
+
+		q.method = "GET";
+		q.body[0] = '\0';
+		q.page = routes[ROUTE_LOGOUT];
+		run(o, ROUTE_LOGOUT, &q, &s[ns++], NULL, 0);
+	}
+
+	return ns;
+}
+
+/*
+ * Start the FastCGI server "argv" and wait for it to listen on "sock".
+ */
+static pid_t
+start_fcgi(char *argv[], const char *sock)
+{
+	pid_t		 pid;
+
+	unlink(sock);
+	if (-1 == (pid = fork()))
+		err(EXIT_FAILURE, "fork");
+	if (0 == pid) {
+		execv(argv[0], argv);
+		err(EXIT_FAILURE, "%s", argv[0]);
+	}
+
+	if ( ! fcgi_wait(sock)) {
+		kill(pid, SIGTERM);
+		errx(EXIT_FAILURE, "%s: not listening", sock);
+	}
+	return pid;
+}
+
+static int
+sample_cmp(const void *a, const void *b)
+{
+	const struct sample *sa = a, *sb = b;
+
+	if (sa->route != sb->route)
+		return sa->route < sb->route ? -1 : 1;
+	return sa->us < sb->us ? -1 : sa->us > sb->us;
+}
+
+/*
+ * The "p" percentile of the "n" sorted samples at "s".
+ */
+static uint32_t
+pct(const struct sample *s, size_t n, double p)
+{
+	size_t	 i = p * n;
+
+	return s[i < n ? i : n - 1].us;
+}
+
+static void
+report(const char *name, const struct sample *s, size_t n, double secs)
+{
+	size_t	 i, fails = 0;
+
+	for (i = 0; i < n; i++)
+		fails += ! s[i].ok;
+	printf("%-14s %8zu %6zu %10.1f %8u %8u %8u\n", name, n, fails,
+		n / secs, pct(s, n, 0.5), pct(s, n, 0.99), pct(s, n, 0.999));
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bopts	 o;
+	struct sample	*s, *all;
+	const char	*db = NULL, *fcgi = NULL, *er;
+	char		**sargv;
+	size_t		 i, j, per, total, *counts;
+	uint64_t	 start;
+	double		 secs;
+	int		 c, st;
+	pid_t		 srv = -1, pid;
+
+	memset(&o, 0, sizeof(struct bopts));
+	o.clients = 8;
+	o.sessions = 20;
+	o.index = 8;
+	o.mods = 1;
+	o.sock = "bench.sock";
+
+	while (-1 != (c = getopt(argc, argv, "C:c:D:F:i:m:n:S:")))
+		switch (c) {
+		case 'C':
+			o.cgi = optarg;
+			break;
+		case 'c':
+			o.clients = strtonum(optarg, 1, 1024, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-c %s: %s", optarg, er);
+			break;
+		case 'D':
+			db = optarg;
+			break;
+		case 'F':
+			fcgi = optarg;
+			break;
+		case 'i':
+			o.index = strtonum(optarg, 0, 1000, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-i %s: %s", optarg, er);
+			break;
+		case 'm':
+			o.mods = strtonum(optarg, 0, 1000, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-m %s: %s", optarg, er);
+			break;
+		case 'n':
+			o.sessions = strtonum(optarg, 1, 1000000, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-n %s: %s", optarg, er);
+			break;
+		case 'S':
+			o.sock = optarg;
+			break;
+		default:
+			goto usage;
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (NULL == db || (NULL == o.cgi) == (NULL == fcgi))
+		goto usage;
+
+	bench_seed(db, o.clients);
+
+	/* The server gets our remaining arguments and its socket. */
+
+	if (NULL != fcgi) {
+		if (NULL == (sargv = calloc(argc + 4, sizeof(char *))))
+			err(EXIT_FAILURE, NULL);
+		sargv[0] = (char *)fcgi;
+		for (i = 0; i < (size_t)argc; i++)
+			sargv[i + 1] = argv[i];
+		sargv[i + 1] = "-s";
+		sargv[i + 2] = (char *)o.sock;
+		srv = start_fcgi(sargv, o.sock);
+		free(sargv);
+	}
+
+	if ( ! check_sessions(&o)) {
+		if (-1 != srv) {
+			kill(srv, SIGTERM);
+			waitpid(srv, &st, 0);
+			unlink(o.sock);
+		}
+		return EXIT_FAILURE;
+	}
+
+	per = o.sessions * (2 + o.index + o.mods);
+	total = o.clients * per;
+	all = mmap(NULL, total * sizeof(struct sample) +
+		o.clients * sizeof(size_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANON, -1, 0);
+	if (MAP_FAILED == all)
+		err(EXIT_FAILURE, "mmap");
+	counts = (size_t *)(all + total);
+
+	start = now_us();
+	for (i = 0; i < o.clients; i++) {
+		if (-1 == (pid = fork()))
+			err(EXIT_FAILURE, "fork");
+		if (0 == pid) {
+			counts[i] = client(&o, i, all + i * per);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	for (i = 0; i < o.clients; i++)
+		if (-1 == wait(&st))
+			err(EXIT_FAILURE, "wait");
+		else if ( ! WIFEXITED(st) || EXIT_SUCCESS != WEXITSTATUS(st))
+			warnx("client failed");
+	secs = (now_us() - start) / 1e6;
+
+	if (-1 != srv) {
+		kill(srv, SIGTERM);
+		waitpid(srv, &st, 0);
+		unlink(o.sock);
+	}
+
+	/* Pack the clients' samples together, then sort by route. */
+
+	for (i = j = 0; i < o.clients; i++) {
+		memmove(all + j, all + i * per,
+			counts[i] * sizeof(struct sample));
+		j += counts[i];
+	}
+	total = j;
+	qsort(all, total, sizeof(struct sample), sample_cmp);
+
+	printf("%s: %zu clients, %.2f seconds\n",
+		NULL != o.cgi ? o.cgi : fcgi, o.clients, secs);
+	printf("%-14s %8s %6s %10s %8s %8s %8s\n", "page", "requests",
+		"fails", "req/s", "p50(us)", "p99(us)", "p999(us)");
+	for (s = all, i = 0; i < ROUTE__MAX; i++) {
+		for (j = 0; s + j < all + total && s[j].route == i; j++)
+			continue;
+		if (j > 0)
+			report(routes[i], s, j, secs);
+		s += j;
+	}
+	for (i = 0; i < total; i++)
+		all[i].route = 0;
+	qsort(all, total, sizeof(struct sample), sample_cmp);
+	report("all", all, total, secs);
+	return EXIT_SUCCESS;
+usage:
+	fprintf(stderr, "usage: %s [-c clients] [-i index] [-m mods] "
+		"[-n sessions] -D db -C cgi\n"
+		"       %s [-c clients] [-i index] [-m mods] "
+		"[-n sessions] [-S socket] -D db -F fcgi [-- args...]\n",
+		getprogname(), getprogname());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,96 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Interfaces shared by the benchmark drivers, bench.c, coldstart.c, and
+ * microbench.c, and implemented in benchutil.c.
+ * These aren't part of the CGI script.
+ */
+
+/*
+ * Phases of the start of a CGI script built with COLDSTART, which
+ * writes when each ended to this descriptor as it exits.
+ */
+#define	COLDSTART_FD	3
+
+enum	cphase {
+	CPHASE_MAIN, /* entering main() */
+	CPHASE_PARSE, /* parsing */
+	CPHASE_ADMIT, /* validate() and admit() */
+	CPHASE_OPEN, /* opening the log and database (if admitted) */
+	CPHASE_HANDLER, /* looking up the session and running the page */
+	CPHASE_EXIT, /* flushing and freeing */
+	CPHASE__MAX
+};
+
+/*
+ * Password of all users added by bench_seed().
+ */
+#define	BENCH_PASS	"benchmark"
+
+/*
+ * A growable buffer, always NUL-terminated.
+ */
+struct	buf {
+	char		*p;
+	size_t		 sz;
+	size_t		 max;
+};
+
+/*
+ * A request to send.
+ */
+struct	breq {
+	const char	*method;
+	const char	*page;
+	char		 body[512];
+	char		 cookie[256];
+};
+
+/*
+ * When a CGI script was run and answered, and its own marks of each
+ * phase if it was built with COLDSTART (otherwise zero), all in
+ * monotonic microseconds.
+ */
+struct	cgitime {
+	uint64_t	 fork;
+	uint64_t	 first; /* first byte of output */
+	uint64_t	 end; /* end of output */
+	uint64_t	 marks[CPHASE__MAX];
+};
+
+__BEGIN_DECLS
+
+void	 bench_seed(const char *, size_t);
+void	 microbench_close(void);
+void	 microbench_enter(void);
+void	 microbench_leave(size_t, const char *);
+int	 microbench_open(const char *, size_t);
+void	 microbench_run(struct kreq *, const char *);
+void	 buf_append(struct buf *, const void *, size_t);
+void	 cgi_send(const char *, const struct breq *, struct buf *,
+		struct cgitime *);
+void	 fcgi_send(const char *, const struct breq *, struct buf *);
+int	 fcgi_wait(const char *);
+void	 form_add(char *, size_t, const char *, const char *);
+int	 resp_parse(const struct buf *, char *, size_t);
+
+__END_DECLS
+
+#endif /* !BENCH_H */
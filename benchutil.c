@@ -0,0 +1,528 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+#include <ksql.h>
+
+#include "extern.h"
+#include "server.h"
+#include "bench.h"
+
+/*
+ * Sending requests to the CGI script and FastCGI server and seeding
+ * their database, for the benchmarks.
+ */
+
+#define	BENCH_ROLE	1 /* FastCGI responder */
+
+/*
+ * As in main.c: the users are seeded where the servers look for them.
+ */
+#ifndef SHARDS
+# define SHARDS 0
+#endif
+
+/*
+ * FastCGI record types.
+ */
+#define	FCGI_BEGIN	1
+#define	FCGI_END	3
+#define	FCGI_PARAMS	4
+#define	FCGI_STDIN	5
+#define	FCGI_STDOUT	6
+
+void
+buf_append(struct buf *b, const void *p, size_t sz)
+{
+
+	if (b->sz + sz + 1 > b->max) {
+		b->max = b->sz + sz + 1024;
+		if (NULL == (b->p = realloc(b->p, b->max)))
+			err(EXIT_FAILURE, NULL);
+	}
+	memcpy(b->p + b->sz, p, sz);
+	b->sz += sz;
+	b->p[b->sz] = '\0';
+}
+
+static void
+write_all(int fd, const void *p, size_t sz)
+{
+	ssize_t	 ssz;
+
+	while (sz > 0) {
+		if (-1 == (ssz = write(fd, p, sz))) {
+			if (EINTR == errno)
+				continue;
+			err(EXIT_FAILURE, "write");
+		}
+		p = (const char *)p + ssz;
+		sz -= ssz;
+	}
+}
+
+/*
+ * Read exactly "sz" bytes.
+ * Returns zero on end of file.
+ */
+static int
+read_all(int fd, void *p, size_t sz)
+{
+	ssize_t	 ssz;
+
+	while (sz > 0) {
+		if (-1 == (ssz = read(fd, p, sz))) {
+			if (EINTR == errno)
+				continue;
+			err(EXIT_FAILURE, "read");
+		} else if (0 == ssz)
+			return 0;
+		p = (char *)p + ssz;
+		sz -= ssz;
+	}
+	return 1;
+}
+
+/*
+ * URL-encode "v" as the value of form field "key", appending to "buf".
+ */
+void
+form_add(char *buf, size_t sz, const char *key, const char *v)
+{
+	char	 enc[4];
+	size_t	 len = strlen(buf);
+
+	if (len > 0)
+		strlcat(buf, "&", sz);
+	strlcat(buf, key, sz);
+	strlcat(buf, "=", sz);
+	for ( ; '\0' != *v; v++) {
+		if (('a' <= *v && *v <= 'z') || ('0' <= *v && *v <= '9') ||
+		    ('A' <= *v && *v <= 'Z') || NULL != strchr("-_.", *v)) {
+			enc[0] = *v;
+			enc[1] = '\0';
+		} else
+			snprintf(enc, sizeof(enc), "%%%02X",
+				(unsigned char)*v);
+		strlcat(buf, enc, sz);
+	}
+}
+
+/*
+ * The CGI environment for a request, also sent as FastCGI parameters.
+ * Returns the number of pairs.
+ */
+static size_t
+cgi_env(const struct breq *q, char env[][2][256], size_t max)
+{
+	size_t	 i = 0;
+
+#define	ENV(_k, ...) do { \
+		if (i < max) { \
+			strlcpy(env[i][0], (_k), sizeof(env[i][0])); \
+			snprintf(env[i][1], sizeof(env[i][1]), __VA_ARGS__); \
+			i++; \
+		} \
+	} while (0)
+
+	ENV("GATEWAY_INTERFACE", "CGI/1.1");
+	ENV("SERVER_PROTOCOL", "HTTP/1.1");
+	ENV("SERVER_NAME", "localhost");
+	ENV("SERVER_PORT", "80");
+	ENV("HTTP_HOST", "localhost");
+	ENV("REMOTE_ADDR", "127.0.0.1");
+	ENV("REQUEST_METHOD", "%s", q->method);
+	ENV("SCRIPT_NAME", "/cgi-bin/yourprog");
+	ENV("PATH_INFO", "/%s.json", q->page);
+	ENV("REQUEST_URI", "/cgi-bin/yourprog/%s.json", q->page);
+	ENV("QUERY_STRING", "%s", "");
+	if ('\0' != q->cookie[0])
+		ENV("HTTP_COOKIE", "%s", q->cookie);
+	if (0 == strcmp(q->method, "POST")) {
+		ENV("CONTENT_TYPE", "application/x-www-form-urlencoded");
+		ENV("CONTENT_LENGTH", "%zu", strlen(q->body));
+	}
+#undef	ENV
+	return i;
+}
+
+static uint64_t
+cgi_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Run the CGI script for a request, reading its output into "out".
+ * If "t" isn't NULL, it's filled in with when the script was run and
+ * answered and its marks, which it writes to COLDSTART_FD.
+ */
+void
+cgi_send(const char *prog, const struct breq *q, 
+	struct buf *out, struct cgitime *t)
+{
+	char		 env[16][2][256];
+	char		*envp[17], *argv[2];
+	char		 envs[16][512];
+	char		 rbuf[BUFSIZ];
+	int		 in[2], o[2], m[2] = { -1, -1 }, fds[6], st;
+	size_t		 i, n;
+	ssize_t		 ssz;
+	pid_t		 pid;
+
+	n = cgi_env(q, env, 16);
+	for (i = 0; i < n; i++) {
+		snprintf(envs[i], sizeof(envs[i]),
+			"%s=%s", env[i][0], env[i][1]);
+		envp[i] = envs[i];
+	}
+	envp[i] = NULL;
+
+	if (-1 == pipe(in) || -1 == pipe(o) ||
+	    (NULL != t && -1 == pipe(m)))
+		err(EXIT_FAILURE, "pipe");
+	if (NULL != t) {
+		memset(t, 0, sizeof(struct cgitime));
+		t->fork = cgi_now();
+	}
+	if (-1 == (pid = fork()))
+		err(EXIT_FAILURE, "fork");
+
+	if (0 == pid) {
+		if (-1 == dup2(in[0], STDIN_FILENO) ||
+		    -1 == dup2(o[1], STDOUT_FILENO) ||
+		    (-1 != m[1] && COLDSTART_FD != m[1] && 
+		     -1 == dup2(m[1], COLDSTART_FD)))
+			_exit(EXIT_FAILURE);
+		fds[0] = in[0];
+		fds[1] = in[1];
+		fds[2] = o[0];
+		fds[3] = o[1];
+		fds[4] = m[0];
+		fds[5] = m[1];
+		for (i = 0; i < 6; i++)
+			if (-1 != fds[i] && 
+			    (-1 == m[1] || COLDSTART_FD != fds[i]))
+				close(fds[i]);
+		argv[0] = (char *)prog;
+		argv[1] = NULL;
+		execve(prog, argv, envp);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(in[0]);
+	close(o[1]);
+	if (-1 != m[1])
+		close(m[1]);
+	write_all(in[1], q->body, strlen(q->body));
+	close(in[1]);
+
+	while ((ssz = read(o[0], rbuf, sizeof(rbuf))) != 0) {
+		if (-1 == ssz && EINTR == errno)
+			continue;
+		else if (-1 == ssz)
+			err(EXIT_FAILURE, "read");
+		if (NULL != t && 0 == t->first)
+			t->first = cgi_now();
+		buf_append(out, rbuf, ssz);
+	}
+	if (NULL != t)
+		t->end = cgi_now();
+	close(o[0]);
+
+	if (-1 == waitpid(pid, &st, 0))
+		err(EXIT_FAILURE, "waitpid");
+
+	/* The marks were written before the script exited. */
+
+	if (-1 != m[0]) {
+		if (sizeof(t->marks) != read(m[0], t->marks, sizeof(t->marks)))
+			memset(t->marks, 0, sizeof(t->marks));
+		close(m[0]);
+	}
+}
+
+static void
+fcgi_record(int fd, int type, const void *p, size_t sz)
+{
+	unsigned char	 hdr[8];
+
+	hdr[0] = 1; /* version */
+	hdr[1] = type;
+	hdr[2] = 0; /* request identifier */
+	hdr[3] = 1;
+	hdr[4] = (sz >> 8) & 0xff;
+	hdr[5] = sz & 0xff;
+	hdr[6] = 0; /* padding */
+	hdr[7] = 0;
+	write_all(fd, hdr, sizeof(hdr));
+	if (sz > 0)
+		write_all(fd, p, sz);
+}
+
+static void
+fcgi_pair_len(struct buf *b, size_t sz)
+{
+	unsigned char	 len[4];
+
+	if (sz < 128) {
+		len[0] = sz;
+		buf_append(b, len, 1);
+		return;
+	}
+	len[0] = ((sz >> 24) & 0x7f) | 0x80;
+	len[1] = (sz >> 16) & 0xff;
+	len[2] = (sz >> 8) & 0xff;
+	len[3] = sz & 0xff;
+	buf_append(b, len, 4);
+}
+
+/*
+ * Send a request over a new connection to the FastCGI server listening
+ * on "sock", reading the response into "out".
+ */
+void
+fcgi_send(const char *sock, const struct breq *q, struct buf *out)
+{
+	struct sockaddr_un sun;
+	struct buf	 params;
+	char		 env[16][2][256];
+	unsigned char	 beg[8], hdr[8], rbuf[65536 + 256];
+	size_t		 i, n, sz;
+	int		 fd;
+
+	memset(&sun, 0, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, sock, sizeof(sun.sun_path));
+	if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0)))
+		err(EXIT_FAILURE, "socket");
+	if (-1 == connect(fd, (struct sockaddr *)&sun, sizeof(sun)))
+		err(EXIT_FAILURE, "%s", sock);
+
+	memset(beg, 0, sizeof(beg));
+	beg[1] = BENCH_ROLE;
+	fcgi_record(fd, FCGI_BEGIN, beg, sizeof(beg));
+
+	memset(&params, 0, sizeof(struct buf));
+	n = cgi_env(q, env, 16);
+	for (i = 0; i < n; i++) {
+		fcgi_pair_len(&params, strlen(env[i][0]));
+		fcgi_pair_len(&params, strlen(env[i][1]));
+		buf_append(&params, env[i][0], strlen(env[i][0]));
+		buf_append(&params, env[i][1], strlen(env[i][1]));
+	}
+	fcgi_record(fd, FCGI_PARAMS, params.p, params.sz);
+	fcgi_record(fd, FCGI_PARAMS, NULL, 0);
+	free(params.p);
+
+	if ((sz = strlen(q->body)) > 0)
+		fcgi_record(fd, FCGI_STDIN, q->body, sz);
+	fcgi_record(fd, FCGI_STDIN, NULL, 0);
+
+	/* Collect standard output until the request ends. */
+
+	while (read_all(fd, hdr, sizeof(hdr))) {
+		sz = (hdr[4] << 8 | hdr[5]) + hdr[6];
+		if ( ! read_all(fd, rbuf, sz))
+			break;
+		if (FCGI_STDOUT == hdr[1])
+			buf_append(out, rbuf, sz - hdr[6]);
+		else if (FCGI_END == hdr[1])
+			break;
+	}
+	close(fd);
+}
+
+/*
+ * Get the status code of a response and, if "tok" isn't NULL, the
+ * session cookie it sets.
+ * Returns the status or -1 if there's none.
+ */
+int
+resp_parse(const struct buf *b, char *tok, size_t sz)
+{
+	const char	*cp, *end, *eq;
+	const char	*tokn = valid_keys[VALID_SESS_TOKEN].name;
+	int		 status = -1;
+	size_t		 len;
+
+	if (NULL == b->p)
+		return -1;
+
+	for (cp = b->p; '\0' != *cp; cp = end + 2) {
+		if (NULL == (end = strstr(cp, "\r\n")) || end == cp)
+			break;
+		if (0 == strncasecmp(cp, "Status: ", 8))
+			status = atoi(cp + 8);
+		if (NULL == tok ||
+		    strncasecmp(cp, "Set-Cookie: ", 12) ||
+		    NULL == (eq = memchr(cp + 12, '=', end - cp - 12)))
+			continue;
+		len = strcspn(eq + 1, ";\r");
+		if (len >= sz)
+			continue;
+		if ((size_t)(eq - cp - 12) == strlen(tokn) &&
+		    0 == strncmp(cp + 12, tokn, strlen(tokn))) {
+			memcpy(tok, eq + 1, len);
+			tok[len] = '\0';
+		}
+	}
+
+	return status;
+}
+
+/*
+ * Wait for a FastCGI server to listen on "sock".
+ * Returns zero if it doesn't within five seconds.
+ */
+int
+fcgi_wait(const char *sock)
+{
+	struct sockaddr_un sun;
+	int		 fd, i;
+
+	memset(&sun, 0, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, sock, sizeof(sun.sun_path));
+
+	for (i = 0; i < 500; i++) {
+		if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0)))
+			err(EXIT_FAILURE, "socket");
+		if (0 == connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+			close(fd);
+			return 1;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	return 0;
+}
+
+/*
+ * Open the database "file" and empty it in a new transaction.
+ */
+static struct ksql *
+seed_open(const char *file)
+{
+	struct ksqlcfg	 cfg;
+	struct ksql	*sql;
+
+	ksql_cfg_defaults(&cfg);
+	if (NULL == (sql = ksql_alloc(&cfg)))
+		errx(EXIT_FAILURE, "ksql_alloc");
+	if (KSQL_OK != ksql_open(sql, file))
+		errx(EXIT_FAILURE, "%s", file);
+
+	ksql_trans_open(sql, 1, 0);
+	ksql_exec(sql, "DELETE FROM sess", 0);
+	ksql_exec(sql, "DELETE FROM user", 0);
+	ksql_exec(sql, "DELETE FROM userdir", 0);
+	return sql;
+}
+
+static void
+seed_close(struct ksql *sql)
+{
+
+	ksql_trans_commit(sql, 0);
+	ksql_free(sql);
+}
+
+/*
+ * Run the insertion "q" of user "id" with "email" and, if not NULL,
+ * "hash".
+ */
+static void
+seed_insert(struct ksql *sql, const char *q,
+	int64_t id, const char *email, const char *hash)
+{
+	struct ksqlstmt	*stmt;
+
+	ksql_stmt_alloc(sql, &stmt, q, 0);
+	ksql_bind_int(stmt, 0, id);
+	ksql_bind_str(stmt, 1, email);
+	if (NULL != hash)
+		ksql_bind_str(stmt, 2, hash);
+	if (KSQL_DONE != ksql_stmt_cstep(stmt))
+		errx(EXIT_FAILURE, "%s: insert", email);
+	ksql_stmt_free(stmt);
+}
+
+/*
+ * Empty the database (and any shards, named as by conn_shards()) and
+ * add one user per client, all with the same password.
+ */
+void
+bench_seed(const char *file, size_t clients)
+{
+	struct ksql	*sql, *shards[SHARDS_MAX];
+	char		 hash[128], email[128], name[1024];
+	size_t		 i, sz = strlen(file), n = SHARDS;
+	int64_t		 id;
+
+	if ( ! pass_hash(BENCH_PASS, hash, sizeof(hash)))
+		errx(EXIT_FAILURE, "pass_hash");
+
+	if (sz > 3 && 0 == strcmp(file + sz - 3, ".db"))
+		sz -= 3;
+
+	sql = seed_open(file);
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "%.*s-%zu%s",
+			(int)sz, file, i, file[sz] ? ".db" : "");
+		shards[i] = seed_open(name);
+	}
+
+	for (i = 0; i < clients; i++) {
+		snprintf(email, sizeof(email),
+			"bench%zu@example.com", i);
+		id = i + 1;
+		if (0 == n) {
+			seed_insert(sql, "INSERT INTO user "
+				"(id,email,hash) VALUES (?,?,?)",
+				id, email, hash);
+			continue;
+		}
+		seed_insert(sql, "INSERT INTO userdir "
+			"(userid,email) VALUES (?,?)", id, email, NULL);
+		seed_insert(shards[id % n], "INSERT INTO user "
+			"(id,email,hash) VALUES (?,?,?)", id, email, hash);
+	}
+
+	for (i = 0; i < n; i++)
+		seed_close(shards[i]);
+	seed_close(sql);
+}
@@ -0,0 +1,270 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * A cached session.
+ * The session (and its user) is a deep copy owned by the cache, its
+ * token pointing to the key.
+ */
+struct	centry {
+	struct sess		 sess;
+	unsigned char		 key[SESS_KEY];
+	time_t			 expires; /* monotonic seconds */
+	struct centry		*next; /* hash chain */
+	TAILQ_ENTRY(centry)	 lru; /* head is most recent */
+};
+
+TAILQ_HEAD(centryq, centry);
+
+/*
+ * A bounded LRU cache of sessions keyed by their keys.
+ * All entries are allocated up front and recycled.
+ */
+struct	sesscache {
+	struct centry	 *entries; /* all entries */
+	struct centry	**hash; /* buckets */
+	size_t		  hashsz; /* number of buckets (power of two) */
+	struct centryq	  used; /* entries in the cache, LRU order */
+	struct centryq	  unused; /* free entries */
+	time_t		  ttl; /* lifetime of an entry (seconds) */
+	struct cachestats stats;
+};
+
+static time_t
+cache_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Keys are random, so any of their bits will do for the bucket.
+ */
+static size_t
+cache_bucket(const struct sesscache *c, const unsigned char *key)
+{
+	uint64_t	 h;
+
+	memcpy(&h, key, sizeof(uint64_t));
+	return h & (c->hashsz - 1);
+}
+
+/*
+ * Unlink an entry from its hash chain and the LRU list and release its
+ * strings, putting it on the unused list.
+ */
+static void
+cache_evict(struct sesscache *c, struct centry *e)
+{
+	struct centry	**pp;
+
+	pp = &c->hash[cache_bucket(c, e->key)];
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+
+	TAILQ_REMOVE(&c->used, e, lru);
+	free(e->sess.user.email);
+	free(e->sess.user.hash);
+	memset(&e->sess, 0, sizeof(struct sess));
+	TAILQ_INSERT_HEAD(&c->unused, e, lru);
+}
+
+/*
+ * Allocate a cache of at most "size" sessions, each living for at most
+ * "ttl" seconds.
+ * Returns NULL on memory exhaustion.
+ */
+struct sesscache *
+cache_alloc(size_t size, time_t ttl)
+{
+	struct sesscache *c;
+	size_t		  i;
+
+	if (NULL == (c = calloc(1, sizeof(struct sesscache))))
+		return NULL;
+
+	for (c->hashsz = 1; c->hashsz < size; c->hashsz <<= 1)
+		continue;
+
+	c->ttl = ttl;
+	c->entries = calloc(size, sizeof(struct centry));
+	c->hash = calloc(c->hashsz, sizeof(struct centry *));
+	if (NULL == c->entries || NULL == c->hash) {
+		free(c->entries);
+		free(c->hash);
+		free(c);
+		return NULL;
+	}
+
+	TAILQ_INIT(&c->used);
+	TAILQ_INIT(&c->unused);
+	for (i = 0; i < size; i++)
+		TAILQ_INSERT_TAIL(&c->unused, &c->entries[i], lru);
+	return c;
+}
+
+void
+cache_free(struct sesscache *c)
+{
+	struct centry	*e;
+
+	if (NULL == c)
+		return;
+	TAILQ_FOREACH(e, &c->used, lru) {
+		free(e->sess.user.email);
+		free(e->sess.user.hash);
+	}
+	free(c->entries);
+	free(c->hash);
+	free(c);
+}
+
+const struct cachestats *
+cache_stats(const struct sesscache *c)
+{
+
+	return &c->stats;
+}
+
+static struct centry *
+cache_find(const struct sesscache *c, const unsigned char *key)
+{
+	struct centry	*e;
+
+	for (e = c->hash[cache_bucket(c, key)]; NULL != e; e = e->next)
+		if (0 == memcmp(e->key, key, SESS_KEY))
+			break;
+	return e;
+}
+
+/*
+ * Look up a session, moving it to the front of the LRU list.
+ * Entries past their lifetime are evicted and not returned.
+ * The result is owned by the cache and valid only until the next cache
+ * operation.
+ * Returns NULL on a miss.
+ */
+const struct sess *
+cache_get(struct sesscache *c, const unsigned char *key)
+{
+	struct centry	*e;
+
+	if (NULL == (e = cache_find(c, key))) {
+		c->stats.misses++;
+		return NULL;
+	} else if (cache_now() >= e->expires) {
+		c->stats.expired++;
+		c->stats.misses++;
+		cache_evict(c, e);
+		return NULL;
+	}
+
+	c->stats.hits++;
+	TAILQ_REMOVE(&c->used, e, lru);
+	TAILQ_INSERT_HEAD(&c->used, e, lru);
+	return &e->sess;
+}
+
+/*
+ * Add a copy of a session to the cache, replacing any existing entry
+ * for it and evicting the least-recently used entry if the cache is
+ * full.
+ * Does nothing if the session has no key or the copy fails.
+ */
+void
+cache_put(struct sesscache *c, const struct sess *s)
+{
+	struct centry	*e;
+	size_t		 b;
+
+	if (SESS_KEY != s->token_sz)
+		return;
+	if (NULL != (e = cache_find(c, s->token)))
+		cache_evict(c, e);
+
+	if (NULL == (e = TAILQ_FIRST(&c->unused))) {
+		if (NULL == (e = TAILQ_LAST(&c->used, centryq)))
+			return;
+		c->stats.evictions++;
+		cache_evict(c, e);
+	}
+
+	e->sess = *s;
+	memcpy(e->key, s->token, SESS_KEY);
+	e->sess.token = e->key;
+	e->sess.user.email = strdup(s->user.email);
+	e->sess.user.hash = strdup(s->user.hash);
+	if (NULL == e->sess.user.email || NULL == e->sess.user.hash) {
+		free(e->sess.user.email);
+		free(e->sess.user.hash);
+		memset(&e->sess, 0, sizeof(struct sess));
+		return;
+	}
+
+	e->expires = cache_now() + c->ttl;
+	b = cache_bucket(c, e->key);
+	e->next = c->hash[b];
+	c->hash[b] = e;
+	TAILQ_REMOVE(&c->unused, e, lru);
+	TAILQ_INSERT_HEAD(&c->used, e, lru);
+}
+
+/*
+ * Remove a session.
+ * Use this when the session is deleted.
+ */
+void
+cache_del_sess(struct sesscache *c, const unsigned char *key)
+{
+	struct centry	*e;
+
+	if (NULL != (e = cache_find(c, key)))
+		cache_evict(c, e);
+}
+
+/*
+ * Remove all sessions of user "userid".
+ * Use this when the user is modified.
+ */
+void
+cache_del_user(struct sesscache *c, int64_t userid)
+{
+	struct centry	*e, *next;
+
+	for (e = TAILQ_FIRST(&c->used); NULL != e; e = next) {
+		next = TAILQ_NEXT(e, lru);
+		if (e->sess.userid == userid)
+			cache_evict(c, e);
+	}
+}
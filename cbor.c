@@ -0,0 +1,222 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * CBOR (RFC 8949) output, written like kcgijson(3) so that a page can
+ * write either with the same calls.
+ * Maps and arrays are of indefinite length, so they may be written as
+ * they're produced, just like JSON objects and arrays.
+ * Integers and strings use the shortest head that holds them.
+ */
+
+#define	CBOR_UINT	0x00 /* major type 0 */
+#define	CBOR_NINT	0x20 /* major type 1 */
+#define	CBOR_TEXT	0x60 /* major type 3 */
+#define	CBOR_ARRAY	0x9f /* major type 4, indefinite */
+#define	CBOR_MAP	0xbf /* major type 5, indefinite */
+#define	CBOR_FALSE	0xf4
+#define	CBOR_TRUE	0xf5
+#define	CBOR_BREAK	0xff
+
+/*
+ * Write the head of major type "type" with argument "v".
+ */
+static void
+cbor_head(struct cborreq *req, unsigned char type, uint64_t v)
+{
+	unsigned char	 buf[9];
+	size_t		 i, sz;
+
+	if (v < 24) {
+		buf[0] = type | v;
+		khttp_write(req->r, (char *)buf, 1);
+		return;
+	} else if (v <= UINT8_MAX) {
+		buf[0] = type | 24;
+		sz = 1;
+	} else if (v <= UINT16_MAX) {
+		buf[0] = type | 25;
+		sz = 2;
+	} else if (v <= UINT32_MAX) {
+		buf[0] = type | 26;
+		sz = 4;
+	} else {
+		buf[0] = type | 27;
+		sz = 8;
+	}
+
+	/* Network byte order. */
+
+	for (i = sz; i > 0; i--, v >>= 8)
+		buf[i] = v & 0xff;
+	khttp_write(req->r, (char *)buf, sz + 1);
+}
+
+static void
+cbor_byte(struct cborreq *req, unsigned char c)
+{
+
+	khttp_write(req->r, (char *)&c, 1);
+}
+
+static void
+cbor_key(struct cborreq *req, const char *key)
+{
+	size_t	 sz = strlen(key);
+
+	cbor_head(req, CBOR_TEXT, sz);
+	khttp_write(req->r, key, sz);
+}
+
+void
+cbor_open(struct cborreq *req, struct kreq *r)
+{
+
+	memset(req, 0, sizeof(struct cborreq));
+	req->r = r;
+}
+
+/*
+ * Close all maps and arrays still open.
+ */
+void
+cbor_close(struct cborreq *req)
+{
+
+	for ( ; req->depth > 0; req->depth--)
+		cbor_byte(req, CBOR_BREAK);
+}
+
+void
+cbor_obj_open(struct cborreq *req)
+{
+
+	cbor_byte(req, CBOR_MAP);
+	req->depth++;
+}
+
+void
+cbor_objp_open(struct cborreq *req, const char *key)
+{
+
+	cbor_key(req, key);
+	cbor_obj_open(req);
+}
+
+void
+cbor_arrayp_open(struct cborreq *req, const char *key)
+{
+
+	cbor_key(req, key);
+	cbor_byte(req, CBOR_ARRAY);
+	req->depth++;
+}
+
+/*
+ * Close the innermost map or array.
+ */
+void
+cbor_obj_close(struct cborreq *req)
+{
+
+	if (0 == req->depth)
+		return;
+	cbor_byte(req, CBOR_BREAK);
+	req->depth--;
+}
+
+void
+cbor_array_close(struct cborreq *req)
+{
+
+	cbor_obj_close(req);
+}
+
+void
+cbor_putbool(struct cborreq *req, int v)
+{
+
+	cbor_byte(req, v ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void
+cbor_putint(struct cborreq *req, int64_t v)
+{
+
+	if (v >= 0)
+		cbor_head(req, CBOR_UINT, v);
+	else
+		cbor_head(req, CBOR_NINT, -(v + 1));
+}
+
+void
+cbor_putstring(struct cborreq *req, const char *v)
+{
+
+	cbor_key(req, v);
+}
+
+void
+cbor_putboolp(struct cborreq *req, const char *key, int v)
+{
+
+	cbor_key(req, key);
+	cbor_putbool(req, v);
+}
+
+void
+cbor_putintp(struct cborreq *req, const char *key, int64_t v)
+{
+
+	cbor_key(req, key);
+	cbor_putint(req, v);
+}
+
+void
+cbor_putstringp(struct cborreq *req, const char *key, const char *v)
+{
+
+	cbor_key(req, key);
+	cbor_putstring(req, v);
+}
+
+/*
+ * Like the json_user_obj() generated from yourprog.kwbp: the user's
+ * exported fields (so not the password hash) in a map keyed "user".
+ * This must be kept in sync with yourprog.kwbp.
+ */
+void
+cbor_user_obj(struct cborreq *req, const struct user *u)
+{
+
+	cbor_objp_open(req, "user");
+	cbor_putstringp(req, "email", u->email);
+	cbor_putintp(req, "id", u->id);
+	cbor_putintp(req, "version", u->version);
+	cbor_obj_close(req);
+}
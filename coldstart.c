@@ -0,0 +1,216 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+#include "bench.h"
+
+/*
+ * Cold-start profile of the CGI script, run by "make coldstart".
+ * We run the script (main.c built with COLDSTART) for each of a few
+ * requests over and over, one at a time, each time noting when we ran
+ * it and when its first and last bytes came, and reading when each of
+ * its phases ended.
+ * The medians are printed by request.
+ * The first column, from running it to main(), is the cost of exec(2)
+ * and any dynamic linking.
+ */
+
+enum	route {
+	ROUTE_NOTFOUND,
+	ROUTE_NOAUTH,
+	ROUTE_LOGIN,
+	ROUTE_INDEX,
+	ROUTE_LOGOUT,
+	ROUTE__MAX
+};
+
+static	const char *const routes[ROUTE__MAX] = {
+	"notfound", /* ROUTE_NOTFOUND */
+	"noauth", /* ROUTE_NOAUTH */
+	"login", /* ROUTE_LOGIN */
+	"index", /* ROUTE_INDEX */
+	"logout", /* ROUTE_LOGOUT */
+};
+
+/*
+ * Columns: time to main(), each phase, first byte, and last byte.
+ */
+#define	COLS	(CPHASE__MAX + 2)
+
+static	const char *const cols[COLS] = {
+	"exec",
+	"parse",
+	"admit",
+	"open",
+	"handler",
+	"exit",
+	"first",
+	"total",
+};
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	const uint64_t *pa = a, *pb = b;
+
+	return *pa < *pb ? -1 : *pa > *pb;
+}
+
+/*
+ * Run the request and note its columns in "row".
+ * Phases that weren't reached take no time.
+ * Returns the status code.
+ */
+static int
+run(const char *cgi, const struct breq *q,
+	uint64_t *row, char *tok, size_t sz)
+{
+	struct buf	 out;
+	struct cgitime	 t;
+	uint64_t	 last;
+	size_t		 i;
+	int		 status;
+
+	memset(&out, 0, sizeof(struct buf));
+	cgi_send(cgi, q, &out, &t);
+	status = resp_parse(&out, tok, sz);
+	free(out.p);
+
+	row[0] = t.marks[CPHASE_MAIN] > t.fork ?
+		t.marks[CPHASE_MAIN] - t.fork : 0;
+	last = t.marks[CPHASE_MAIN];
+	for (i = 1; i < CPHASE__MAX; i++) {
+		row[i] = 0;
+		if (0 == t.marks[i] || 0 == last)
+			continue;
+		row[i] = t.marks[i] - last;
+		last = t.marks[i];
+	}
+	row[CPHASE__MAX] = t.first > t.fork ? t.first - t.fork : 0;
+	row[CPHASE__MAX + 1] = t.end - t.fork;
+	return status;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct breq	 q, lq;
+	const char	*db = NULL, *cgi = NULL, *er;
+	char		 tok[64];
+	uint64_t	*rows, *col;
+	size_t		 i, j, k, n = 50;
+	int		 c;
+
+	while (-1 != (c = getopt(argc, argv, "C:D:n:")))
+		switch (c) {
+		case 'C':
+			cgi = optarg;
+			break;
+		case 'D':
+			db = optarg;
+			break;
+		case 'n':
+			n = strtonum(optarg, 1, 100000, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-n %s: %s", optarg, er);
+			break;
+		default:
+			goto usage;
+		}
+
+	if (NULL == db || NULL == cgi)
+		goto usage;
+
+	bench_seed(db, 1);
+
+	rows = calloc(ROUTE__MAX * n * COLS, sizeof(uint64_t));
+	col = calloc(n, sizeof(uint64_t));
+	if (NULL == rows || NULL == col)
+		err(EXIT_FAILURE, NULL);
+
+#define	ROW(_r, _i) (rows + ((_r) * n + (_i)) * COLS)
+
+	memset(&lq, 0, sizeof(struct breq));
+	lq.method = "POST";
+	lq.page = routes[ROUTE_LOGIN];
+	form_add(lq.body, sizeof(lq.body),
+		valid_keys[VALID_USER_EMAIL].name, "bench0@example.com");
+	form_add(lq.body, sizeof(lq.body),
+		valid_keys[VALID_USER_HASH].name, BENCH_PASS);
+
+	for (i = 0; i < n; i++) {
+		memset(&q, 0, sizeof(struct breq));
+		q.method = "GET";
+		q.page = "nothing";
+		if (404 != run(cgi, &q, ROW(ROUTE_NOTFOUND, i), NULL, 0))
+			errx(EXIT_FAILURE, "notfound: expected 404");
+		q.page = "index";
+		if (403 != run(cgi, &q, ROW(ROUTE_NOAUTH, i), NULL, 0))
+			errx(EXIT_FAILURE, "noauth: expected 403");
+
+		tok[0] = '\0';
+		if (200 != run(cgi, &lq, ROW(ROUTE_LOGIN, i),
+		    tok, sizeof(tok)) || '\0' == tok[0])
+			errx(EXIT_FAILURE, "login failed");
+		snprintf(q.cookie, sizeof(q.cookie), "%s=%s",
+			valid_keys[VALID_SESS_TOKEN].name, tok);
+
+		if (200 != run(cgi, &q, ROW(ROUTE_INDEX, i), NULL, 0))
+			errx(EXIT_FAILURE, "index failed");
+		q.page = "logout";
+		if (200 != run(cgi, &q, ROW(ROUTE_LOGOUT, i), NULL, 0))
+			errx(EXIT_FAILURE, "logout failed");
+	}
+
+	printf("%s: %zu runs, median microseconds\n", cgi, n);
+	printf("%-10s", "page");
+	for (k = 0; k < COLS; k++)
+		printf(" %8s", cols[k]);
+	printf("\n");
+
+	for (j = 0; j < ROUTE__MAX; j++) {
+		printf("%-10s", routes[j]);
+		for (k = 0; k < COLS; k++) {
+			for (i = 0; i < n; i++)
+				col[i] = ROW(j, i)[k];
+			qsort(col, n, sizeof(uint64_t), u64_cmp);
+			printf(" %8llu", (unsigned long long)col[n / 2]);
+		}
+		printf("\n");
+	}
+
+#undef	ROW
+	free(rows);
+	free(col);
+	return EXIT_SUCCESS;
+usage:
+	fprintf(stderr, "usage: %s [-n runs] -D db -C cgi\n",
+		getprogname());
+	return EXIT_FAILURE;
+}
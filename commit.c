@@ -0,0 +1,936 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * How long (milliseconds) a worker waits for its write to be committed
+ * before giving up on it.
+ */
+#define	COMMIT_TIMEOUT	5000
+
+/*
+ * How long (milliseconds) a worker's transaction may be open in the
+ * committer before it's rolled back.
+ * The batch and other transactions wait for it, so this is well under
+ * COMMIT_TIMEOUT.
+ */
+#define	COMMIT_TRANS_MAX	1000
+
+/*
+ * Operations that aren't statements.
+ */
+#define	COMMIT_TRANS_OPEN	CSTMT__MAX
+#define	COMMIT_TRANS_CLOSE	(CSTMT__MAX + 1)
+
+/*
+ * A request from a worker to the committer.
+ * The operation is the statement that would run it.
+ * Writes, which are run in batches, are CSTMT_SESS_INSERT (userid,
+ * expires, key), CSTMT_SESS_DELETE_TOKEN (key), and
+ * CSTMT_USER_UPDATE_EMAIL or CSTMT_USER_UPDATE_PASS (id, str).
+ * When brokering (see conn_broker()), there are also reads, which are
+ * run right away: CSTMT_SESS_GET_CREDS (now, ro, key),
+ * CSTMT_USER_GET_CREDS (str), CSTMT_SESS_ITERATE_USER (userid, now), and
+ * CSTMT_SESS_PRUNE (now, batch); and COMMIT_TRANS_OPEN and
+ * COMMIT_TRANS_CLOSE (commit), between which the worker's requests (all
+ * marked "trans") are run in its own transaction.
+ */
+struct	commitreq {
+	uint64_t	 seq;
+	unsigned int	 op;
+	int		 trans;
+	int64_t		 args[2];
+	unsigned char	 key[SESS_KEY];
+	char		 str[256];
+};
+
+/*
+ * The result of the conn.c function for the operation, sent only once
+ * its transaction has committed, and any session (less its key, which
+ * the worker has) or user it found.
+ * Sessions are iterated with one answer per session, each with "more"
+ * set, followed by one with the count.
+ */
+struct	commitrep {
+	uint64_t	 seq;
+	int64_t		 rc;
+	int		 more;
+	int64_t		 userid;
+	int64_t		 id;
+	int64_t		 expires;
+	int64_t		 uid;
+	int64_t		 version;
+	char		 email[256];
+	char		 hash[128];
+};
+
+/*
+ * A write waiting in the committer for its batch to be run.
+ */
+struct	commitq {
+	size_t		 slot; /* worker it came from */
+	struct commitreq req;
+	int64_t		 rc;
+};
+
+/*
+ * Group commit.
+ * Like the hashing pool in verify.c, each worker slot has a socketpair,
+ * with the committer polling all of the other ends.
+ * Writes received within the wait (or up to the batch size) are run in
+ * one transaction, so they share one sync to disk.
+ */
+struct	commit {
+	int		 (*fds)[2]; /* per worker: worker, committer end */
+	size_t		  workers;
+	size_t		  batch; /* maximum writes per transaction */
+	int		  wait; /* maximum wait (milliseconds) */
+	int		  fd; /* this worker's end or -1 */
+	uint64_t	  seq; /* last request sent by this worker */
+	uint64_t	  ahead; /* commit_trans_open() not yet answered */
+	int		  aheaderr; /* it failed */
+	int		  trans; /* in commit_trans_open() */
+};
+
+/*
+ * The result of a failed operation, as returned by the conn.c function.
+ */
+static int64_t
+commit_fail(unsigned int op)
+{
+
+	return CSTMT_SESS_INSERT == op || CSTMT_SESS_PRUNE == op ||
+		CSTMT_SESS_ITERATE_USER == op ? -1 : 0;
+}
+
+/*
+ * Whether the operation is a write, which is batched.
+ */
+static int
+commit_iswrite(unsigned int op)
+{
+
+	return CSTMT_SESS_INSERT == op || CSTMT_SESS_DELETE_TOKEN == op ||
+		CSTMT_USER_UPDATE_EMAIL == op ||
+		CSTMT_USER_UPDATE_PASS == op;
+}
+
+/*
+ * The transaction open in the committer, if any.
+ * Only one runs at a time: others are noted until it's closed.
+ */
+struct	committrans {
+	int		 open;
+	size_t		 slot; /* worker it's for */
+	struct timespec	 start;
+	uint64_t	*waits; /* per worker: its open or zero */
+};
+
+/*
+ * Create the sockets for "workers" worker slots, committing at most
+ * "batch" writes together, waiting no more than "wait" milliseconds
+ * after the first to gather them.
+ * This must be called before forking.
+ * Returns NULL on failure.
+ */
+struct commit *
+commit_alloc(size_t workers, size_t batch, int wait)
+{
+	struct commit	*m;
+	size_t		 i;
+
+	if (NULL == (m = calloc(1, sizeof(struct commit))))
+		return NULL;
+
+	m->fd = -1;
+	m->workers = workers;
+	m->batch = batch;
+	m->wait = wait;
+
+	if (NULL == (m->fds = calloc(workers, sizeof(int[2])))) {
+		free(m);
+		return NULL;
+	}
+	for (i = 0; i < workers; i++)
+		m->fds[i][0] = m->fds[i][1] = -1;
+
+	for (i = 0; i < workers; i++)
+		if (-1 == socketpair(AF_UNIX,
+		    SOCK_SEQPACKET, 0, m->fds[i])) {
+			kutil_warn(NULL, NULL, "socketpair");
+			m->fds[i][0] = m->fds[i][1] = -1;
+			commit_free(m);
+			return NULL;
+		}
+
+	return m;
+}
+
+void
+commit_free(struct commit *m)
+{
+	size_t	 i;
+
+	if (NULL == m)
+		return;
+	for (i = 0; i < m->workers; i++) {
+		if (-1 != m->fds[i][0])
+			close(m->fds[i][0]);
+		if (-1 != m->fds[i][1])
+			close(m->fds[i][1]);
+	}
+	free(m->fds);
+	free(m);
+}
+
+/*
+ * Called by the worker in "slot" after forking.
+ * Closes all descriptors but its own.
+ */
+void
+commit_worker(struct commit *m, size_t slot)
+{
+	size_t	 i;
+
+	for (i = 0; i < m->workers; i++) {
+		close(m->fds[i][1]);
+		m->fds[i][1] = -1;
+		if (i == slot)
+			continue;
+		close(m->fds[i][0]);
+		m->fds[i][0] = -1;
+	}
+	m->fd = m->fds[slot][0];
+}
+
+/*
+ * Run the write "req" in the committer's transaction.
+ * Returns what the conn.c function returns.
+ */
+static int64_t
+commit_write(struct conn *c, const struct commitreq *req)
+{
+
+	switch (req->op) {
+	case CSTMT_SESS_INSERT:
+		return conn_sess_insert(c, req->args[0],
+			req->key, req->args[1]);
+	case CSTMT_SESS_DELETE_TOKEN:
+		return conn_sess_delete_token(c, req->key);
+	case CSTMT_USER_UPDATE_EMAIL:
+		return conn_user_update_email(c, req->str, req->args[0]);
+	case CSTMT_USER_UPDATE_PASS:
+		return conn_user_update_hash(c, req->str, req->args[0]);
+	default:
+		break;
+	}
+	return commit_fail(req->op);
+}
+
+/*
+ * Send "rep" to the worker at "fd", then clear it so that no strings
+ * are left over for the next answer.
+ */
+static void
+commit_reply(int fd, struct commitrep *rep)
+{
+
+	if (-1 == send(fd, rep, sizeof(struct commitrep), 0))
+		kutil_warn(NULL, NULL, "send");
+	explicit_bzero(rep, sizeof(struct commitrep));
+}
+
+/*
+ * Copy a found user into "rep".
+ * Returns zero if its strings don't fit.
+ */
+static int
+commit_user_rep(struct commitrep *rep, const struct user *u)
+{
+
+	rep->uid = u->id;
+	rep->version = u->version;
+	return strlcpy(rep->email, u->email, sizeof(rep->email)) <
+		sizeof(rep->email) &&
+		strlcpy(rep->hash, u->hash, sizeof(rep->hash)) <
+		sizeof(rep->hash);
+}
+
+/*
+ * Copy a found session into "rep", as commit_user_rep().
+ */
+static int
+commit_sess_rep(struct commitrep *rep, const struct sess *s)
+{
+
+	rep->userid = s->userid;
+	rep->id = s->id;
+	rep->expires = s->expires;
+	return commit_user_rep(rep, &s->user);
+}
+
+/*
+ * Where a session iteration in the committer sends its sessions.
+ */
+struct	commititer {
+	int		 fd;
+	uint64_t	 seq; /* of the request */
+	struct commitrep rep;
+};
+
+static void
+commit_iter_row(const struct sess *s, void *arg)
+{
+	struct commititer *it = arg;
+
+	/*
+	 * We can't stop the iteration: skip what we can't send.
+	 * Each answer has been cleared by the one before.
+	 */
+
+	it->rep.seq = it->seq;
+	it->rep.more = 1;
+	if (commit_sess_rep(&it->rep, s))
+		commit_reply(it->fd, &it->rep);
+}
+
+/*
+ * Run the read "req" from the worker at "fd" and answer it.
+ * Strings of found rows are allocated from "a".
+ */
+static void
+commit_read(struct conn *c, struct arena *a,
+	int fd, const struct commitreq *req)
+{
+	struct commititer it;
+	struct sess	 s;
+	struct user	 u;
+	int64_t		 rc = commit_fail(req->op);
+
+	memset(&it, 0, sizeof(struct commititer));
+	it.fd = fd;
+	it.seq = req->seq;
+
+	switch (req->op) {
+	case CSTMT_SESS_GET_CREDS:
+		rc = conn_sess_lookup(c, a, 
+			req->args[1], req->key, req->args[0], &s);
+		if (rc > 0 && ! commit_sess_rep(&it.rep, &s))
+			rc = 0;
+		break;
+	case CSTMT_USER_GET_CREDS:
+		rc = conn_user_get_email(c, a, req->str, &u);
+		if (rc > 0 && ! commit_user_rep(&it.rep, &u))
+			rc = 0;
+		break;
+	case CSTMT_SESS_ITERATE_USER:
+		rc = conn_sess_iterate_user(NULL != c->replica ?
+			c->replica : c, req->args[0], req->args[1],
+			commit_iter_row, &it);
+		break;
+	case CSTMT_SESS_PRUNE:
+		rc = conn_sess_prune(c, req->args[0], req->args[1]);
+		break;
+	default:
+		break;
+	}
+
+	it.rep.seq = req->seq;
+	it.rep.rc = rc;
+	it.rep.more = 0;
+	commit_reply(fd, &it.rep);
+	arena_reset(a);
+}
+
+/*
+ * Run a batch of "qsz" writes in one transaction, then answer them.
+ * If the transaction fails, all of them fail.
+ */
+static void
+commit_flush(struct commit *m, struct conn *c,
+	struct commitq *q, size_t qsz)
+{
+	struct commitrep rep;
+	size_t		 i;
+	int		 ok;
+
+	ok = conn_trans_open(c);
+
+	for (i = 0; ok && ! c->transerr && i < qsz; i++)
+		q[i].rc = commit_write(c, &q[i].req);
+
+	if ( ! ok || ! conn_trans_close(c, 1))
+		for (i = 0; i < qsz; i++)
+			q[i].rc = commit_fail(q[i].req.op);
+
+	memset(&rep, 0, sizeof(struct commitrep));
+	for (i = 0; i < qsz; i++) {
+		rep.seq = q[i].req.seq;
+		rep.rc = q[i].rc;
+		explicit_bzero(&q[i].req, sizeof(struct commitreq));
+		commit_reply(m->fds[q[i].slot][1], &rep);
+	}
+}
+
+/*
+ * Milliseconds since "then".
+ */
+static int
+commit_elapsed(const struct timespec *then)
+{
+	struct timespec	 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000 +
+		(now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/*
+ * Open the transaction requested by "seq" from the worker in "slot",
+ * first committing the batch so far, and answer it.
+ */
+static void
+commit_trans_start(struct commit *m, struct conn *c, struct commitq *q,
+	size_t *qsz, struct committrans *t, size_t slot, uint64_t seq)
+{
+	struct commitrep rep;
+
+	if (*qsz > 0)
+		commit_flush(m, c, q, *qsz);
+	*qsz = 0;
+
+	memset(&rep, 0, sizeof(struct commitrep));
+	rep.seq = seq;
+	rep.rc = conn_trans_open(c);
+	commit_reply(m->fds[slot][1], &rep);
+	if (0 == rep.rc)
+		return;
+
+	t->open = 1;
+	t->slot = slot;
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+/*
+ * Close the open transaction, committing it if "commit" is set and
+ * nothing in it failed, then open the next one waiting.
+ * Waiting workers are taken in turn after the one just closed, so none
+ * waits forever.
+ * Returns what conn_trans_close() returns.
+ */
+static int
+commit_trans_end(struct commit *m, struct conn *c, struct commitq *q,
+	size_t *qsz, struct committrans *t, int commit)
+{
+	size_t		 i, slot;
+	uint64_t	 seq;
+	int		 rc;
+
+	rc = conn_trans_close(c, commit);
+	t->open = 0;
+
+	for (i = 1; i <= m->workers && ! t->open; i++) {
+		slot = (t->slot + i) % m->workers;
+		if (0 == (seq = t->waits[slot]))
+			continue;
+		t->waits[slot] = 0;
+		commit_trans_start(m, c, q, qsz, t, slot, seq);
+	}
+	return rc;
+}
+
+/*
+ * Run the committer process on the database "file" and, if not empty,
+ * its read-only copy "replica" until killed.
+ * Returns EXIT_FAILURE on error.
+ */
+int
+commit_run(struct commit *m, const char *file, const char *replica)
+{
+	struct pollfd	 *pfd;
+	struct commitq	 *q;
+	struct commitreq  req;
+	struct commitrep  rep;
+	struct committrans t;
+	struct conn	 *c, *r;
+	struct arena	  a;
+	struct timespec	  start;
+	size_t		  i, qsz = 0;
+	ssize_t		  ssz;
+	int		  ms;
+
+	memset(&a, 0, sizeof(struct arena));
+	memset(&rep, 0, sizeof(struct commitrep));
+	memset(&t, 0, sizeof(struct committrans));
+
+	pfd = calloc(m->workers, sizeof(struct pollfd));
+	q = calloc(m->batch, sizeof(struct commitq));
+	t.waits = calloc(m->workers, sizeof(uint64_t));
+	if (NULL == pfd || NULL == q || NULL == t.waits) {
+		kutil_warn(NULL, NULL, "calloc");
+		free(pfd);
+		free(q);
+		free(t.waits);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < m->workers; i++) {
+		close(m->fds[i][0]);
+		m->fds[i][0] = -1;
+		pfd[i].fd = m->fds[i][1];
+	}
+
+	/*
+	 * The second connection serves other workers' reads while a
+	 * transaction is open in the first, seeing only what's been
+	 * committed.
+	 */
+
+	c = conn_open(file);
+	r = NULL != c ? conn_open(file) : NULL;
+	if (NULL == r) {
+		kutil_warnx(NULL, NULL, "commit: conn_open");
+		conn_close(c);
+		free(pfd);
+		free(q);
+		free(t.waits);
+		return EXIT_FAILURE;
+	}
+
+	if ('\0' != replica[0] && ! conn_replica(c, replica))
+		kutil_warnx(NULL, NULL, "commit: conn_replica: "
+			"running without replica");
+
+#if HAVE_PLEDGE
+	if (-1 == pledge("stdio rpath cpath wpath flock fattr", NULL)) {
+		kutil_warn(NULL, NULL, "pledge");
+		conn_close(c);
+		conn_close(r);
+		free(pfd);
+		free(q);
+		free(t.waits);
+		return EXIT_FAILURE;
+	}
+#endif
+
+	for (;;) {
+		/*
+		 * Wait forever for the first write, then until due.
+		 * An open transaction holds back the batch, so instead
+		 * wait until it has run too long.
+		 * Workers waiting for a transaction aren't heard until
+		 * it opens, nor is anybody but the transaction's worker
+		 * while the batch is full.
+		 */
+
+		if (t.open || qsz > 0) {
+			ms = t.open ?
+				COMMIT_TRANS_MAX - commit_elapsed(&t.start) :
+				m->wait - commit_elapsed(&start);
+			if (ms < 0)
+				ms = 0;
+		} else
+			ms = INFTIM;
+
+		for (i = 0; i < m->workers; i++)
+			pfd[i].events = 0 != t.waits[i] ||
+				(qsz == m->batch &&
+				 ! (t.open && i == t.slot)) ? 0 : POLLIN;
+
+		if (-1 == poll(pfd, m->workers, ms)) {
+			if (EINTR == errno)
+				continue;
+			kutil_warn(NULL, NULL, "poll");
+			break;
+		}
+
+		/*
+		 * Writes wait for their batch; anything else is run
+		 * right away.
+		 * A transaction first commits the batch so far, and
+		 * while it's open, others' reads go to the second
+		 * connection and their transactions wait their turn.
+		 * Requests marked for a transaction that isn't open
+		 * (say, one that ran too long) are refused, as are
+		 * others' prunes, which would wait on its lock.
+		 */
+
+		for (i = 0; i < m->workers; i++) {
+			if ( ! (POLLIN & pfd[i].revents))
+				continue;
+			if (qsz == m->batch && ! (t.open && i == t.slot))
+				continue;
+			ssz = recv(pfd[i].fd, &req,
+				sizeof(struct commitreq), MSG_DONTWAIT);
+			if (ssz != sizeof(struct commitreq))
+				continue;
+			req.str[sizeof(req.str) - 1] = '\0';
+			rep.seq = req.seq;
+
+			if (req.trans && t.open && i == t.slot) {
+				if (COMMIT_TRANS_CLOSE == req.op) {
+					rep.rc = commit_trans_end(m,
+						c, q, &qsz, &t, req.args[0]);
+					commit_reply(pfd[i].fd, &rep);
+				} else if (commit_iswrite(req.op)) {
+					rep.rc = commit_write(c, &req);
+					commit_reply(pfd[i].fd, &rep);
+				} else
+					commit_read(c, &a, pfd[i].fd, &req);
+			} else if (req.trans ||
+			    (t.open && CSTMT_SESS_PRUNE == req.op)) {
+				rep.rc = commit_fail(req.op);
+				commit_reply(pfd[i].fd, &rep);
+			} else if (COMMIT_TRANS_OPEN == req.op) {
+				if (t.open)
+					t.waits[i] = req.seq;
+				else
+					commit_trans_start(m,
+						c, q, &qsz, &t, i, req.seq);
+			} else if (commit_iswrite(req.op)) {
+				q[qsz].slot = i;
+				q[qsz].req = req;
+				if (0 == qsz++)
+					clock_gettime(CLOCK_MONOTONIC, &start);
+			} else
+				commit_read(t.open ? r : c,
+					&a, pfd[i].fd, &req);
+
+			explicit_bzero(&req, sizeof(struct commitreq));
+		}
+
+		if (t.open && commit_elapsed(&t.start) >= COMMIT_TRANS_MAX) {
+			kutil_warnx(NULL, NULL, "commit: "
+				"transaction timeout");
+			commit_trans_end(m, c, q, &qsz, &t, 0);
+		}
+
+		if (t.open || 0 == qsz)
+			continue;
+		if (qsz < m->batch && commit_elapsed(&start) < m->wait)
+			continue;
+
+		commit_flush(m, c, q, qsz);
+		qsz = 0;
+	}
+
+	arena_free(&a);
+	conn_close(c);
+	conn_close(r);
+	free(pfd);
+	free(q);
+	free(t.waits);
+	return EXIT_FAILURE;
+}
+
+/*
+ * Send "req" to the committer, numbering it.
+ * Returns its number or zero on failure.
+ */
+static uint64_t
+commit_send(struct commit *m, struct commitreq *req)
+{
+	ssize_t		 ssz;
+
+	req->seq = ++m->seq;
+	req->trans = m->trans;
+	ssz = send(m->fd, req, sizeof(struct commitreq), 0);
+	explicit_bzero(req, sizeof(struct commitreq));
+	if (-1 == ssz) {
+		kutil_warn(NULL, NULL, "send");
+		return 0;
+	}
+	return m->seq;
+}
+
+/*
+ * Wait for the answer to request "seq" (or its next answer, when
+ * iterating), filling it into "rep".
+ * The answer to a commit_trans_open() comes first, as the committer
+ * answers each worker in order: its failure is noted in "aheaderr".
+ * Anything else is stale, from a request we've since given up on.
+ * Returns zero if the committer doesn't answer in time.
+ */
+static int
+commit_recv(struct commit *m, uint64_t seq, struct commitrep *rep)
+{
+	struct pollfd	 pfd;
+	struct timespec	 start, now;
+	ssize_t		 ssz;
+	int		 ms;
+
+	pfd.fd = m->fd;
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = COMMIT_TIMEOUT -
+			((now.tv_sec - start.tv_sec) * 1000 +
+			 (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (ms <= 0) {
+			kutil_warnx(NULL, NULL, "commit: timeout");
+			return 0;
+		}
+		if (-1 == poll(&pfd, 1, ms)) {
+			if (EINTR == errno)
+				continue;
+			kutil_warn(NULL, NULL, "poll");
+			return 0;
+		} else if ( ! (POLLIN & pfd.revents))
+			continue;
+		ssz = recv(m->fd, rep, sizeof(struct commitrep), 0);
+		if (-1 == ssz) {
+			if (EINTR == errno)
+				continue;
+			kutil_warn(NULL, NULL, "recv");
+			return 0;
+		} else if (ssz != sizeof(struct commitrep))
+			continue;
+		if (rep->seq == seq) {
+			rep->email[sizeof(rep->email) - 1] = '\0';
+			rep->hash[sizeof(rep->hash) - 1] = '\0';
+			return 1;
+		}
+		if (0 == m->ahead || rep->seq != m->ahead)
+			continue;
+		if (rep->rc <= 0)
+			m->aheaderr = 1;
+		m->ahead = 0;
+	}
+}
+
+/*
+ * Send "req" and wait for its answer in "rep".
+ * Returns the answer's result or "fail".
+ */
+static int64_t
+commit_call(struct commit *m, struct commitreq *req,
+	struct commitrep *rep, int64_t fail)
+{
+	uint64_t	 seq;
+
+	if (0 == (seq = commit_send(m, req)) ||
+	    ! commit_recv(m, seq, rep))
+		return fail;
+	return rep->rc;
+}
+
+/*
+ * Have the committer run operation "op" (see struct commitreq) and wait
+ * for it to be committed.
+ * Returns what the conn.c function for the operation would return,
+ * failing if the committer doesn't answer in time.
+ */
+int64_t
+commit_exec(struct commit *m, enum cstmt op, int64_t a,
+	int64_t b, const unsigned char *key, const char *str)
+{
+	struct commitreq req;
+	struct commitrep rep;
+	int64_t		 rc;
+
+	if (NULL != str && strlen(str) >= sizeof(req.str))
+		return commit_fail(op);
+
+	memset(&req, 0, sizeof(struct commitreq));
+	req.op = op;
+	req.args[0] = a;
+	req.args[1] = b;
+	if (NULL != key)
+		memcpy(req.key, key, SESS_KEY);
+	if (NULL != str)
+		strlcpy(req.str, str, sizeof(req.str));
+	rc = commit_call(m, &req, &rep, commit_fail(op));
+	explicit_bzero(&req, sizeof(struct commitreq));
+	explicit_bzero(&rep, sizeof(struct commitrep));
+	return rc;
+}
+
+/*
+ * Look up a session as conn_sess_lookup() in the committer's database.
+ * Returns as conn_sess_lookup().
+ */
+int
+commit_sess_get(struct commit *m, struct arena *a, int ro,
+	const unsigned char *key, time_t now, struct sess *s)
+{
+	struct commitreq req;
+	struct commitrep rep;
+	int64_t		 rc;
+
+	memset(&req, 0, sizeof(struct commitreq));
+	req.op = CSTMT_SESS_GET_CREDS;
+	req.args[0] = now;
+	req.args[1] = ro;
+	memcpy(req.key, key, SESS_KEY);
+	rc = commit_call(m, &req, &rep, 0);
+	explicit_bzero(&req, sizeof(struct commitreq));
+	if (rc > 0) {
+		memset(s, 0, sizeof(struct sess));
+		s->userid = rep.userid;
+		s->token = arena_memdup(a, key, SESS_KEY);
+		s->token_sz = SESS_KEY;
+		s->id = rep.id;
+		s->expires = rep.expires;
+		s->user.id = rep.uid;
+		s->user.version = rep.version;
+		s->user.email = arena_strdup(a, rep.email);
+		s->user.hash = arena_strdup(a, rep.hash);
+		if (NULL == s->token ||
+		    NULL == s->user.email || NULL == s->user.hash)
+			rc = 0;
+	}
+	explicit_bzero(&rep, sizeof(struct commitrep));
+	return rc > 0 ? rc : 0;
+}
+
+/*
+ * Look up a user as conn_user_get_email() in the committer's database.
+ * Returns zero if not found or on error, non-zero if found.
+ */
+int
+commit_user_get(struct commit *m, struct arena *a,
+	const char *email, struct user *u)
+{
+	struct commitreq req;
+	struct commitrep rep;
+	int64_t		 rc;
+
+	if (strlen(email) >= sizeof(req.str))
+		return 0;
+
+	memset(&req, 0, sizeof(struct commitreq));
+	req.op = CSTMT_USER_GET_CREDS;
+	strlcpy(req.str, email, sizeof(req.str));
+	if ((rc = commit_call(m, &req, &rep, 0)) > 0) {
+		memset(u, 0, sizeof(struct user));
+		u->id = rep.uid;
+		u->version = rep.version;
+		u->email = arena_strdup(a, rep.email);
+		u->hash = arena_strdup(a, rep.hash);
+		if (NULL == u->email || NULL == u->hash)
+			rc = 0;
+	}
+	explicit_bzero(&rep, sizeof(struct commitrep));
+	return rc > 0;
+}
+
+/*
+ * Iterate over sessions as conn_sess_iterate_user() in the committer's
+ * database (or its replica, if it has one).
+ * Sessions are passed to "cb" as they arrive, while the committer is
+ * still stepping through the rest.
+ * Returns the number of sessions or -1 on error.
+ */
+int64_t
+commit_sess_iterate(struct commit *m, int64_t userid,
+	time_t now, sess_cb cb, void *arg)
+{
+	struct commitreq req;
+	struct commitrep rep;
+	struct sess	 s;
+	uint64_t	 seq;
+
+	memset(&req, 0, sizeof(struct commitreq));
+	req.op = CSTMT_SESS_ITERATE_USER;
+	req.args[0] = userid;
+	req.args[1] = now;
+	if (0 == (seq = commit_send(m, &req)))
+		return -1;
+
+	while (commit_recv(m, seq, &rep)) {
+		if ( ! rep.more)
+			return rep.rc;
+		memset(&s, 0, sizeof(struct sess));
+		s.userid = rep.userid;
+		s.id = rep.id;
+		s.expires = rep.expires;
+		s.user.id = rep.uid;
+		s.user.version = rep.version;
+		s.user.email = rep.email;
+		s.user.hash = rep.hash;
+		(*cb)(&s, arg);
+	}
+	return -1;
+}
+
+/*
+ * Open a transaction in the committer, all of whose requests are run
+ * in it until commit_trans_close().
+ * This doesn't wait for the transaction to open: its answer arrives
+ * before that of the first request in it, and if it failed, so do they
+ * and the transaction.
+ * Returns zero on failure.
+ */
+int
+commit_trans_open(struct commit *m)
+{
+	struct commitreq req;
+	uint64_t	 seq;
+
+	if (m->trans)
+		return 0;
+	memset(&req, 0, sizeof(struct commitreq));
+	req.op = COMMIT_TRANS_OPEN;
+	if (0 == (seq = commit_send(m, &req)))
+		return 0;
+	m->ahead = seq;
+	m->aheaderr = 0;
+	m->trans = 1;
+	return 1;
+}
+
+/*
+ * Close the transaction opened by commit_trans_open(), committing it if
+ * "commit" is set and nothing in it failed.
+ * Returns zero if the transaction was rolled back, non-zero if it was
+ * committed.
+ */
+int
+commit_trans_close(struct commit *m, int commit)
+{
+	struct commitreq req;
+	struct commitrep rep;
+	int64_t		 rc;
+
+	if ( ! m->trans)
+		return 0;
+	memset(&req, 0, sizeof(struct commitreq));
+	req.op = COMMIT_TRANS_CLOSE;
+	req.args[0] = commit;
+	rc = commit_call(m, &req, &rep, 0);
+	m->trans = 0;
+	m->ahead = 0;
+	return rc > 0 && commit && ! m->aheaderr;
+}
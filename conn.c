@@ -0,0 +1,1221 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#if defined(__linux__)
+# include <crypt.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+#include <ksql.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * How each connection uses the database: see the Makefile.
+ * The journal mode is a property of the database file, so it's set when
+ * the database is created or upgraded and only checked here.
+ */
+#ifndef DB_JOURNAL
+# define DB_JOURNAL "wal"
+#endif
+#ifndef DB_SYNC
+# define DB_SYNC "full"
+#endif
+#ifndef DB_MMAP
+# define DB_MMAP 67108864
+#endif
+#ifndef DB_CACHE
+# define DB_CACHE -8192
+#endif
+#ifndef DB_BUSY
+# define DB_BUSY 5000
+#endif
+
+/*
+ * These mirror the queries in the generated db.c, but are prepared once
+ * per connection and reset after each use instead of being compiled and
+ * freed on every call.
+ * They must be kept in sync with yourprog.kwbp.
+ */
+static	const char *const stmts[CSTMT__MAX] = {
+	/* CSTMT_CHANGES: not generated. */
+	"SELECT changes()",
+	/*
+	 * CSTMT_DIR_GET, CSTMT_DIR_UPDATE_EMAIL: not generated, nor is
+	 * their table (see DB_USERDIR in the Makefile), the directory
+	 * of users when they're spread over shards.
+	 */
+	"SELECT userid FROM userdir WHERE email = ?",
+	"UPDATE userdir SET email = ? WHERE userid = ?",
+	/*
+	 * CSTMT_SESS_CONFIRM: not generated.
+	 * Whether a session found in the replica is still here: see
+	 * conn_sess_lookup().
+	 * Like CSTMT_SESS_GET_CREDS, it's answered by the index alone.
+	 */
+	"SELECT id FROM sess INDEXED BY sess_token "
+	 "WHERE token = ? AND expires > ?",
+	/* CSTMT_SESS_DELETE_TOKEN */
+	"DELETE FROM sess WHERE token = ?",
+	/*
+	 * CSTMT_SESS_GET_CREDS: this doesn't select the token, which
+	 * the caller already has, so the sess_token index (see DB_INDEX
+	 * in the Makefile) covers the session's columns; the unique
+	 * sess_key index makes sure there's at most one.
+	 */
+	"SELECT sess.userid,sess.id,sess.expires,"
+	 "_a.email,_a.hash,_a.id,_a.version FROM sess "
+	 "INDEXED BY sess_token "
+	 "INNER JOIN user AS _a ON _a.id=sess.userid "
+	 "WHERE sess.token = ? AND sess.expires > ?",
+	/* CSTMT_SESS_INSERT */
+	"INSERT INTO sess (userid,token,expires) VALUES (?,?,?)",
+	/* 
+	 * CSTMT_SESS_ITERATE_USER: also skips expired sessions and
+	 * doesn't select the tokens, which aren't shown.
+	 */
+	"SELECT sess.userid,sess.id,sess.expires,"
+	 "_a.email,_a.hash,_a.id,_a.version FROM sess "
+	 "INNER JOIN user AS _a ON _a.id=sess.userid "
+	 "WHERE sess.userid = ? AND sess.expires > ? ORDER BY sess.id",
+	/*
+	 * CSTMT_SESS_PRUNE: not generated.
+	 * Sessions' expiry is fixed when they're made, with the same
+	 * lifetime for all, so the oldest identifiers expire first: only
+	 * the oldest batch is looked at, bounding the work done (not
+	 * just the rows deleted) without an index on "expires".
+	 */
+	"DELETE FROM sess WHERE id IN "
+	 "(SELECT id FROM sess ORDER BY id LIMIT ?) AND expires <= ?",
+	/* CSTMT_USER_GET_CREDS */
+	"SELECT email,hash,id,version FROM user WHERE email = ?",
+	/* 
+	 * CSTMT_USER_UPDATE_EMAIL, CSTMT_USER_UPDATE_PASS: unlike the
+	 * generated ones, these also bump the version, which is what
+	 * the index page's ETag is made from.
+	 */
+	"UPDATE user SET email = ?, version = version + 1 WHERE id = ?",
+	"UPDATE user SET hash = ?, version = version + 1 WHERE id = ?",
+};
+
+#if TRACE
+/*
+ * Trace spans of the statements, named for the generated functions.
+ */
+static	const char *const traces[CSTMT__MAX] = {
+	"db_changes", /* CSTMT_CHANGES */
+	"db_dir_get", /* CSTMT_DIR_GET */
+	"db_dir_update_email", /* CSTMT_DIR_UPDATE_EMAIL */
+	"db_sess_confirm", /* CSTMT_SESS_CONFIRM */
+	"db_sess_delete_token", /* CSTMT_SESS_DELETE_TOKEN */
+	"db_sess_get_creds", /* CSTMT_SESS_GET_CREDS */
+	"db_sess_insert", /* CSTMT_SESS_INSERT */
+	"db_sess_iterate_user", /* CSTMT_SESS_ITERATE_USER */
+	"db_sess_prune", /* CSTMT_SESS_PRUNE */
+	"db_user_get_creds", /* CSTMT_USER_GET_CREDS */
+	"db_user_update_email", /* CSTMT_USER_UPDATE_EMAIL */
+	"db_user_update_pass", /* CSTMT_USER_UPDATE_PASS */
+};
+#endif
+
+/*
+ * Check a password against its stored hash.
+ * Returns zero on mismatch, non-zero on match.
+ */
+int
+pass_check(const char *pass, const char *hash)
+{
+#if defined(__OpenBSD__)
+	return 0 == crypt_checkpass(pass, hash);
+#else
+	const char	*res;
+
+	res = crypt(pass, hash);
+	return NULL != res && 0 == strcmp(res, hash);
+#endif
+}
+
+/*
+ * Hash a password into "buf" of size "sz" as the generated db.c does,
+ * so either may check the other's hashes: bcrypt on OpenBSD, otherwise
+ * SHA-512 crypt(3) (see LDADD_CRYPT) with a 16-character salt.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+pass_hash(const char *pass, char *buf, size_t sz)
+{
+#if defined(__OpenBSD__)
+	return 0 == crypt_newhash(pass, "blowfish,a", buf, sz);
+#else
+	static const char set[] = "./0123456789"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz";
+	char		 salt[3 + 16 + 1];
+	const char	*res;
+	size_t		 i;
+
+	memcpy(salt, "$6$", 3);
+	for (i = 3; i < sizeof(salt) - 1; i++)
+		salt[i] = set[arc4random_uniform(sizeof(set) - 1)];
+	salt[i] = '\0';
+	if (NULL == (res = crypt(pass, salt)))
+		return 0;
+	return strlcpy(buf, res, sz) < sz;
+#endif
+}
+
+/*
+ * Apply the per-connection settings and check the journal mode.
+ * A wrong journal mode only warns: readers will block on writers, but
+ * nothing will break.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+conn_profile(struct conn *c)
+{
+	struct ksqlstmt	*stmt;
+	char		 buf[160];
+
+	snprintf(buf, sizeof(buf), 
+		"PRAGMA synchronous = %s;"
+		"PRAGMA mmap_size = %lld;"
+		"PRAGMA cache_size = %lld;"
+		"PRAGMA busy_timeout = %lld",
+		DB_SYNC, (long long)DB_MMAP, 
+		(long long)DB_CACHE, (long long)DB_BUSY);
+
+	if (KSQL_OK != ksql_exec(c->db, buf, CSTMT__MAX))
+		return 0;
+	if (c->ro && KSQL_OK != ksql_exec(c->db, 
+	    "PRAGMA query_only = 1", CSTMT__MAX))
+		return 0;
+	if (KSQL_OK != ksql_stmt_alloc(c->db, 
+	    &stmt, "PRAGMA journal_mode", CSTMT__MAX))
+		return 0;
+	if (KSQL_ROW == ksql_stmt_step(stmt) &&
+	    strcasecmp(ksql_stmt_str(stmt, 0), DB_JOURNAL))
+		kutil_warnx(NULL, NULL, "%s: journal mode is %s, not %s",
+			c->file, ksql_stmt_str(stmt, 0), DB_JOURNAL);
+	ksql_stmt_free(stmt);
+	return 1;
+}
+
+/*
+ * Open the underlying database.
+ * Unlike the generated db_open(), we don't exit on error: we want to be
+ * able to reconnect.
+ * Nor do we split into a child process, which would cost a round trip
+ * for every bind, step, and column: callers must instead pledge what
+ * SQLite needs to open, lock, and journal the database.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+conn_connect(struct conn *c)
+{
+	struct ksqlcfg	 cfg;
+
+	ksql_cfg_defaults(&cfg);
+	cfg.flags &= ~KSQL_EXIT_ON_ERR;
+
+	if (NULL == (c->db = ksql_alloc(&cfg)))
+		return 0;
+	TRACE_BEGIN("db_open");
+	if (KSQL_OK != ksql_open(c->db, c->file) || ! conn_profile(c)) {
+		TRACE_END();
+		ksql_free(c->db);
+		c->db = NULL;
+		return 0;
+	}
+	TRACE_END();
+	return 1;
+}
+
+/*
+ * Free all prepared statements and the database.
+ */
+static void
+conn_disconnect(struct conn *c)
+{
+	size_t	 i;
+
+	for (i = 0; i < CSTMT__MAX; i++)
+		if (NULL != c->stmts[i]) {
+			ksql_stmt_free(c->stmts[i]);
+			c->stmts[i] = NULL;
+		}
+	if (NULL != c->db) {
+		ksql_free(c->db);
+		c->db = NULL;
+	}
+}
+
+/*
+ * Called when a statement has failed with a database (not constraint)
+ * error.
+ * Reconnects if we haven't already done so this operation, letting the
+ * caller try again.
+ * Returns zero if the caller should give up.
+ */
+static int
+conn_retry(struct conn *c, int *tries)
+{
+
+	/* Reconnecting would lose the transaction's earlier writes. */
+
+	if (c->trans) {
+		c->transerr = 1;
+		return 0;
+	}
+	if ((*tries)++ > 0)
+		return 0;
+
+	kutil_warnx(NULL, NULL, "%s: reconnecting", c->file);
+	c->stats.reconnects++;
+	conn_disconnect(c);
+	return conn_connect(c);
+}
+
+/*
+ * Get the prepared statement "id", compiling it if it's not yet been
+ * prepared on this connection.
+ * Its use is traced until it's reset with conn_reset().
+ * Returns NULL on failure.
+ */
+static struct ksqlstmt *
+conn_stmt(struct conn *c, enum cstmt id)
+{
+
+	if (NULL != c->stmts[id]) {
+		c->stats.reused++;
+		TRACE_BEGIN(traces[id]);
+		return c->stmts[id];
+	}
+	if (NULL == c->db)
+		return NULL;
+	TRACE_BEGIN(traces[id]);
+	if (KSQL_OK != ksql_stmt_alloc
+	    (c->db, &c->stmts[id], stmts[id], id)) {
+		TRACE_END();
+		c->stmts[id] = NULL;
+		return NULL;
+	}
+	c->stats.compiled++;
+	return c->stmts[id];
+}
+
+/*
+ * Reset a statement got from conn_stmt() once done with it.
+ */
+static void
+conn_reset(struct ksqlstmt *stmt)
+{
+
+	ksql_stmt_reset(stmt);
+	TRACE_END();
+}
+
+/*
+ * Open a connection to the database "file".
+ * Statements are prepared on first use.
+ * Returns NULL on failure.
+ */
+struct conn *
+conn_open(const char *file)
+{
+	struct conn	*c;
+
+	if (NULL == (c = calloc(1, sizeof(struct conn))))
+		return NULL;
+	if (NULL == (c->file = strdup(file))) {
+		free(c);
+		return NULL;
+	}
+	if ( ! conn_connect(c)) {
+		free(c->file);
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+/*
+ * A connection without a database of its own: everything is run by the
+ * committer "m" (see commit_run()), which brokers all database access.
+ * So the caller need never open the database and may give up the right
+ * to do so from the start.
+ * Returns NULL on failure.
+ */
+struct conn *
+conn_broker(struct commit *m)
+{
+	struct conn	*c;
+
+	if (NULL == (c = calloc(1, sizeof(struct conn))))
+		return NULL;
+	c->commit = m;
+	c->broker = 1;
+	return c;
+}
+
+/*
+ * Whether a write is run by the committer: always if brokered,
+ * otherwise if group commit is enabled and we're not in a transaction
+ * of our own.
+ */
+static int
+conn_remote(const struct conn *c)
+{
+
+	return NULL != c->commit && (c->broker || ! c->trans);
+}
+
+void
+conn_close(struct conn *c)
+{
+	size_t	 i;
+
+	if (NULL == c)
+		return;
+	conn_close(c->replica);
+	for (i = 0; i < c->shardsz; i++)
+		conn_close(c->shards[i]);
+	free(c->shards);
+	conn_disconnect(c);
+	cache_free(c->cache);
+	free(c->file);
+	free(c);
+}
+
+/*
+ * Open a read-only copy of the database "file", such as one kept by
+ * replication or copying, for read-only pages to use instead of "c".
+ * Its sessions may lag behind, so lookups that miss it still go to "c".
+ * Returns zero on failure, non-zero on success.
+ */
+int
+conn_replica(struct conn *c, const char *file)
+{
+	struct conn	*r;
+
+	if (NULL == (r = calloc(1, sizeof(struct conn))))
+		return 0;
+	r->ro = 1;
+	if (NULL == (r->file = strdup(file))) {
+		free(r);
+		return 0;
+	}
+	if ( ! conn_connect(r)) {
+		free(r->file);
+		free(r);
+		return 0;
+	}
+	c->replica = r;
+	return 1;
+}
+
+/*
+ * Spread users and their sessions over "n" databases (at most
+ * SHARDS_MAX), leaving that of "c" with only the directory of users by
+ * e-mail address.
+ * User "id" is in shard (id % n), whose file is that of "c" with "-"
+ * and the shard's number before any ".db" suffix; and a session's key
+ * names its shard (see conn_sess_key()), so that a lookup opens only
+ * the one database.
+ * Shards are opened when first used.
+ * This may be used neither with a committer nor a replica.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+conn_shards(struct conn *c, size_t n)
+{
+	size_t	 i, sz;
+	int	 suffix;
+
+	if (0 == n || n > SHARDS_MAX || NULL != c->shards ||
+	    NULL != c->commit || NULL != c->replica)
+		return 0;
+	if (NULL == (c->shards = calloc(n, sizeof(struct conn *))))
+		return 0;
+
+	sz = strlen(c->file);
+	suffix = sz > 3 && 0 == strcmp(c->file + sz - 3, ".db");
+	if (suffix)
+		sz -= 3;
+
+	for (c->shardsz = 0; c->shardsz < n; c->shardsz++) {
+		i = c->shardsz;
+		if (NULL == (c->shards[i] = 
+		    calloc(1, sizeof(struct conn))))
+			break;
+		if (-1 == asprintf(&c->shards[i]->file, "%.*s-%zu%s", 
+		    (int)sz, c->file, i, suffix ? ".db" : "")) {
+			free(c->shards[i]);
+			break;
+		}
+	}
+	if (c->shardsz == n)
+		return 1;
+
+	for (i = 0; i < c->shardsz; i++)
+		conn_close(c->shards[i]);
+	free(c->shards);
+	c->shards = NULL;
+	c->shardsz = 0;
+	return 0;
+}
+
+/*
+ * Shard "i" of "c", opened if it's not yet been.
+ * Returns NULL on failure.
+ */
+static struct conn *
+conn_shard(struct conn *c, size_t i)
+{
+	struct conn	*s = c->shards[i];
+
+	if (NULL == s->db && ! conn_connect(s)) {
+		kutil_warnx(NULL, NULL, "%s: cannot open", s->file);
+		return NULL;
+	}
+	return s;
+}
+
+/*
+ * The connection holding user "userid": "c" itself unless sharded.
+ * Returns NULL on failure.
+ */
+static struct conn *
+conn_user(struct conn *c, int64_t userid)
+{
+
+	if (NULL == c->shards)
+		return c;
+	return conn_shard(c, (uint64_t)userid % c->shardsz);
+}
+
+/*
+ * The connection holding the session with "key", as conn_user().
+ */
+static struct conn *
+conn_key(struct conn *c, const unsigned char *key)
+{
+
+	if (NULL == c->shards)
+		return c;
+	if (key[SESS_KEY - 1] >= c->shardsz)
+		return NULL;
+	return conn_shard(c, key[SESS_KEY - 1]);
+}
+
+/*
+ * Make a new session key for user "userid" into "key" (SESS_KEY bytes).
+ * If sharded, its last byte isn't random but names the user's shard.
+ */
+void
+conn_sess_key(const struct conn *c, int64_t userid, unsigned char *key)
+{
+
+	arc4random_buf(key, SESS_KEY);
+	if (NULL != c->shards)
+		key[SESS_KEY - 1] = (uint64_t)userid % c->shardsz;
+}
+
+/*
+ * Start a transaction in which to run several writes.
+ * Within it, a failed statement isn't retried but makes
+ * conn_trans_close() roll back.
+ * If brokered, the transaction is the committer's: others' writes
+ * wait until it's closed (or rolled back for running too long), but
+ * their reads don't.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+conn_trans_open(struct conn *c)
+{
+	int	 tries = 0;
+
+	if (c->broker) {
+		if ( ! commit_trans_open(c->commit))
+			return 0;
+		c->trans = 1;
+		c->transerr = 0;
+		return 1;
+	}
+
+	for (;;) {
+		if (NULL != c->db &&
+		    KSQL_OK == ksql_trans_open(c->db, 1, 0))
+			break;
+		if ( ! conn_retry(c, &tries))
+			return 0;
+	}
+	c->trans = 1;
+	c->transerr = 0;
+	return 1;
+}
+
+/*
+ * End the transaction started with conn_trans_open(), committing it if
+ * "commit" is set and none of its statements failed.
+ * If sharded, the transaction is the directory's, which the shards
+ * written in it joined (see shard_user_update()): they're committed
+ * first, then the directory, which is rolled back if any of them
+ * failed.
+ * (There's no two-phase commit: a crash in between leaves the shards'
+ * writes without the directory's.)
+ * Returns zero if the transaction was rolled back, non-zero if it was
+ * committed.
+ */
+int
+conn_trans_close(struct conn *c, int commit)
+{
+	size_t	 i;
+
+	c->trans = 0;
+	if (c->broker)
+		return commit_trans_close(c->commit, commit);
+	for (i = 0; i < c->shardsz; i++)
+		if (c->shards[i]->trans &&
+		    ! conn_trans_close(c->shards[i], 
+		      commit && ! c->transerr))
+			commit = 0;
+	if (NULL == c->db)
+		return 0;
+	if (commit && ! c->transerr &&
+	    KSQL_OK == ksql_trans_commit(c->db, 0))
+		return 1;
+	ksql_trans_rollback(c->db, 0);
+	return 0;
+}
+
+/*
+ * Copy a cached session into "p", with its strings and key from "a".
+ * Returns zero on memory exhaustion.
+ */
+static int
+sess_copy(struct arena *a, struct sess *p, const struct sess *s)
+{
+
+	*p = *s;
+	p->token = arena_memdup(a, s->token, s->token_sz);
+	p->user.email = arena_strdup(a, s->user.email);
+	p->user.hash = arena_strdup(a, s->user.hash);
+	return NULL != p->token && 
+		NULL != p->user.email && NULL != p->user.hash;
+}
+
+/*
+ * Look up a session in the database of "c" alone.
+ * See conn_sess_get_creds().
+ */
+static int
+sess_get_creds(struct conn *c, struct arena *a,
+	const unsigned char *key, time_t now, struct sess *s)
+{
+	struct ksqlstmt	 *stmt;
+	enum ksqlc	  rc;
+	int		  tries = 0, found = 0;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_SESS_GET_CREDS))) {
+			ksql_bind_blob(stmt, 0, key, SESS_KEY);
+			ksql_bind_int(stmt, 1, now);
+			rc = ksql_stmt_step(stmt);
+			if (KSQL_ROW == rc || KSQL_DONE == rc)
+				break;
+			conn_reset(stmt);
+		}
+		if ( ! conn_retry(c, &tries))
+			return 0;
+	}
+
+	if (KSQL_ROW == rc) {
+		memset(s, 0, sizeof(struct sess));
+		s->userid = ksql_stmt_int(stmt, 0);
+		s->token = arena_memdup(a, key, SESS_KEY);
+		s->token_sz = SESS_KEY;
+		s->id = ksql_stmt_int(stmt, 1);
+		s->expires = ksql_stmt_int(stmt, 2);
+		s->user.email = arena_strdup(a, ksql_stmt_str(stmt, 3));
+		s->user.hash = arena_strdup(a, ksql_stmt_str(stmt, 4));
+		s->user.id = ksql_stmt_int(stmt, 5);
+		s->user.version = ksql_stmt_int(stmt, 6);
+		found = NULL != s->token &&
+			NULL != s->user.email && NULL != s->user.hash;
+	}
+
+	conn_reset(stmt);
+	return found;
+}
+
+/*
+ * Whether the session "s" is still in the database of "c", unexpired.
+ * Returns zero if not or on error.
+ */
+static int
+sess_confirm(struct conn *c, const struct sess *s, time_t now)
+{
+	struct ksqlstmt	 *stmt;
+	enum ksqlc	  rc;
+	int		  tries = 0, found;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_SESS_CONFIRM))) {
+			ksql_bind_blob(stmt, 0, s->token, SESS_KEY);
+			ksql_bind_int(stmt, 1, now);
+			rc = ksql_stmt_step(stmt);
+			if (KSQL_ROW == rc || KSQL_DONE == rc)
+				break;
+			conn_reset(stmt);
+		}
+		if ( ! conn_retry(c, &tries))
+			return 0;
+	}
+
+	found = KSQL_ROW == rc && ksql_stmt_int(stmt, 0) == s->id;
+	conn_reset(stmt);
+	return found;
+}
+
+/*
+ * Look up a session in the database alone, first in the replica if
+ * "ro" is set and there is one.
+ * The replica may lag: a session found there (with its user, which may
+ * be as stale) must still be in the database, lest one logged out or
+ * pruned there go on working.
+ * If brokered, the committer does this for us.
+ * Returns zero if not found or on error, 1 if found in the database, or
+ * 2 if found in the replica.
+ */
+int
+conn_sess_lookup(struct conn *c, struct arena *a, int ro,
+	const unsigned char *key, time_t now, struct sess *s)
+{
+
+	if (c->broker)
+		return commit_sess_get(c->commit, a, ro, key, now, s);
+	if (ro && NULL != c->replica &&
+	    sess_get_creds(c->replica, a, key, now, s))
+		return sess_confirm(c, s, now) ? 2 : 0;
+	if (NULL == (c = conn_key(c, key)))
+		return 0;
+	return sess_get_creds(c, a, key, now, s);
+}
+
+/*
+ * Look up a session in the shared or per-process cache, if any, then as
+ * conn_sess_lookup().
+ * Sessions from the replica aren't cached: one since deleted from the
+ * database might still be there.
+ */
+static int
+sess_get(struct conn *c, struct arena *a, int ro,
+	const unsigned char *key, time_t now, struct sess *s)
+{
+	const struct sess *cs;
+	uint64_t	  gen = 0;
+	int		  rc;
+
+	/* Cached sessions may have expired since being cached. */
+
+	if (NULL != c->shm) {
+		gen = shmcache_gen(c->shm);
+		if (shmcache_get(c->shm, a, key, s) &&
+		    s->expires > now)
+			return 1;
+	} else if (NULL != c->cache &&
+	    NULL != (cs = cache_get(c->cache, key)) &&
+	    cs->expires > now)
+		return sess_copy(a, s, cs);
+
+	if (0 == (rc = conn_sess_lookup(c, a, ro, key, now, s)))
+		return 0;
+	else if (2 == rc)
+		return 1;
+	if (NULL != c->shm)
+		shmcache_put(c->shm, s, gen);
+	else if (NULL != c->cache)
+		cache_put(c->cache, s);
+	return 1;
+}
+
+/*
+ * Like db_sess_get_creds(), but consulting the shared or per-process
+ * session cache (if any) before the database.
+ * The session is filled into "s", with its strings allocated from "a",
+ * so there's nothing to free.
+ * Sessions expiring at or before "now" are not returned.
+ * Returns zero if not found or on error, non-zero if found.
+ */
+int
+conn_sess_get_creds(struct conn *c, struct arena *a,
+	const unsigned char *key, time_t now, struct sess *s)
+{
+
+	return sess_get(c, a, 0, key, now, s);
+}
+
+/*
+ * Like conn_sess_get_creds(), but for read-only pages, which may look
+ * in the replica (if any) before the database.
+ */
+int
+conn_sess_get_creds_ro(struct conn *c, struct arena *a,
+	const unsigned char *key, time_t now, struct sess *s)
+{
+
+	return sess_get(c, a, 1, key, now, s);
+}
+
+/*
+ * Look up the user with the e-mail address "email" in the directory of
+ * a sharded connection.
+ * Returns the user's identifier or -1 if not found or on error.
+ */
+static int64_t
+dir_get(struct conn *c, const char *email)
+{
+	struct ksqlstmt	*stmt;
+	enum ksqlc	 rc;
+	int		 tries = 0;
+	int64_t		 id = -1;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_DIR_GET))) {
+			ksql_bind_str(stmt, 0, email);
+			rc = ksql_stmt_step(stmt);
+			if (KSQL_ROW == rc || KSQL_DONE == rc)
+				break;
+			conn_reset(stmt);
+		}
+		if ( ! conn_retry(c, &tries))
+			return -1;
+	}
+
+	if (KSQL_ROW == rc)
+		id = ksql_stmt_int(stmt, 0);
+	conn_reset(stmt);
+	return id;
+}
+
+/*
+ * Look up a user by e-mail address without checking the password.
+ * This lets the caller check the password elsewhere with pass_check().
+ * If sharded, the directory says which shard to look in.
+ * The user is filled into "u", with its strings allocated from "a".
+ * Returns zero if not found or on error, non-zero if found.
+ */
+int
+conn_user_get_email(struct conn *c, struct arena *a,
+	const char *email, struct user *u)
+{
+	struct ksqlstmt	*stmt;
+	enum ksqlc	 rc;
+	int		 tries = 0, found = 0;
+	int64_t		 id;
+
+	if (c->broker)
+		return commit_user_get(c->commit, a, email, u);
+	if (NULL != c->shards &&
+	    (-1 == (id = dir_get(c, email)) ||
+	     NULL == (c = conn_user(c, id))))
+		return 0;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_USER_GET_CREDS))) {
+			ksql_bind_str(stmt, 0, email);
+			rc = ksql_stmt_step(stmt);
+			if (KSQL_ROW == rc || KSQL_DONE == rc)
+				break;
+			conn_reset(stmt);
+		}
+		if ( ! conn_retry(c, &tries))
+			return 0;
+	}
+
+	if (KSQL_ROW == rc) {
+		memset(u, 0, sizeof(struct user));
+		u->email = arena_strdup(a, ksql_stmt_str(stmt, 0));
+		u->hash = arena_strdup(a, ksql_stmt_str(stmt, 1));
+		u->id = ksql_stmt_int(stmt, 2);
+		u->version = ksql_stmt_int(stmt, 3);
+		found = NULL != u->email && NULL != u->hash;
+	}
+
+	conn_reset(stmt);
+	return found;
+}
+
+/*
+ * Like db_user_get_creds(), filling in "u" as conn_user_get_email().
+ * Returns zero if not found, if the password doesn't match, or on
+ * error, non-zero otherwise.
+ */
+int
+conn_user_get_creds(struct conn *c, struct arena *a,
+	const char *email, const char *pass, struct user *u)
+{
+
+	return conn_user_get_email(c, a, email, u) &&
+		pass_check(pass, u->hash);
+}
+
+/*
+ * Like db_sess_iterate_user(), but only for sessions expiring after
+ * "now".
+ * Each session is passed to "cb" as it's stepped, so the caller may
+ * write it out right away: nothing is kept between rows, and the
+ * session's strings are good only during the call.
+ * Sessions are passed without their keys.
+ * A failure after the first row isn't retried, as the caller would see
+ * rows twice.
+ * Returns the number of sessions or -1 on error.
+ */
+int64_t
+conn_sess_iterate_user(struct conn *c, int64_t userid, 
+	time_t now, sess_cb cb, void *arg)
+{
+	struct ksqlstmt	*stmt;
+	struct sess	 s;
+	enum ksqlc	 rc;
+	int		 tries = 0;
+	int64_t		 count = 0;
+
+	if (c->broker)
+		return commit_sess_iterate(c->commit, userid, now, cb, arg);
+	if (NULL == (c = conn_user(c, userid)))
+		return -1;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_SESS_ITERATE_USER))) {
+			ksql_bind_int(stmt, 0, userid);
+			ksql_bind_int(stmt, 1, now);
+			rc = ksql_stmt_step(stmt);
+			if (KSQL_ROW == rc || KSQL_DONE == rc)
+				break;
+			conn_reset(stmt);
+		}
+		if ( ! conn_retry(c, &tries))
+			return -1;
+	}
+
+	for ( ; KSQL_ROW == rc; rc = ksql_stmt_step(stmt)) {
+		memset(&s, 0, sizeof(struct sess));
+		s.userid = ksql_stmt_int(stmt, 0);
+		s.id = ksql_stmt_int(stmt, 1);
+		s.expires = ksql_stmt_int(stmt, 2);
+		s.user.email = (char *)ksql_stmt_str(stmt, 3);
+		s.user.hash = (char *)ksql_stmt_str(stmt, 4);
+		s.user.id = ksql_stmt_int(stmt, 5);
+		s.user.version = ksql_stmt_int(stmt, 6);
+		(*cb)(&s, arg);
+		count++;
+	}
+
+	conn_reset(stmt);
+	return KSQL_DONE == rc ? count : -1;
+}
+
+/*
+ * Like db_sess_insert().
+ * If group commit is enabled, the committer runs this for us and
+ * answers once it's committed.
+ * Returns the new session identifier or -1 on failure.
+ */
+int64_t
+conn_sess_insert(struct conn *c, int64_t userid, 
+	const unsigned char *key, time_t expires)
+{
+	struct ksqlstmt	*stmt;
+	enum ksqlc	 rc;
+	int64_t		 id = -1;
+	int		 tries = 0;
+
+	if (conn_remote(c))
+		return commit_exec(c->commit, CSTMT_SESS_INSERT,
+			userid, expires, key, NULL);
+	if (NULL == (c = conn_user(c, userid)))
+		return -1;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_SESS_INSERT))) {
+			ksql_bind_int(stmt, 0, userid);
+			ksql_bind_blob(stmt, 1, key, SESS_KEY);
+			ksql_bind_int(stmt, 2, expires);
+			rc = ksql_stmt_cstep(stmt);
+			if (KSQL_DONE == rc || KSQL_CONSTRAINT == rc)
+				break;
+			conn_reset(stmt);
+		}
+		if ( ! conn_retry(c, &tries))
+			return -1;
+	}
+
+	conn_reset(stmt);
+	if (KSQL_DONE == rc)
+		ksql_lastid(c->db, &id);
+	return id;
+}
+
+static int
+sess_delete_token(struct conn *c, const unsigned char *key)
+{
+	struct ksqlstmt	*stmt;
+	enum ksqlc	 rc;
+	int		 tries = 0;
+
+	if (NULL == (c = conn_key(c, key)))
+		return 0;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_SESS_DELETE_TOKEN))) {
+			ksql_bind_blob(stmt, 0, key, SESS_KEY);
+			rc = ksql_stmt_step(stmt);
+			conn_reset(stmt);
+			if (KSQL_DONE == rc)
+				break;
+		}
+		if ( ! conn_retry(c, &tries))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Like db_sess_delete_token(), run by the committer if group commit is
+ * enabled.
+ * Returns zero on failure, non-zero on success (even if the session
+ * didn't exist).
+ */
+int
+conn_sess_delete_token(struct conn *c, const unsigned char *key)
+{
+
+	if (NULL != c->cache)
+		cache_del_sess(c->cache, key);
+
+	if (conn_remote(c)) {
+		if ( ! commit_exec(c->commit, 
+		    CSTMT_SESS_DELETE_TOKEN, 0, 0, key, NULL))
+			return 0;
+	} else if ( ! sess_delete_token(c, key))
+		return 0;
+
+	/* Other workers must see this once it's out of the database. */
+
+	if (NULL != c->shm)
+		shmcache_del_sess(c->shm, key);
+	return 1;
+}
+
+/*
+ * Delete those of the oldest "batch" sessions that expired at or before
+ * "now".
+ * Each call is its own short transaction, so call this repeatedly (say,
+ * between requests) rather than clearing out everything at once.
+ * If sharded, each call prunes one shard chosen at random, so that even
+ * short-lived CGI processes get to all of them in time.
+ * Returns the number of sessions deleted or -1 on failure.
+ */
+int64_t
+conn_sess_prune(struct conn *c, time_t now, int64_t batch)
+{
+	struct ksqlstmt	*stmt;
+	enum ksqlc	 rc;
+	int		 tries = 0;
+
+	if (c->broker)
+		return commit_exec(c->commit, 
+			CSTMT_SESS_PRUNE, now, batch, NULL, NULL);
+	if (NULL != c->shards && NULL == (c = 
+	    conn_shard(c, arc4random_uniform(c->shardsz))))
+		return -1;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, CSTMT_SESS_PRUNE))) {
+			ksql_bind_int(stmt, 0, batch);
+			ksql_bind_int(stmt, 1, now);
+			rc = ksql_stmt_step(stmt);
+			conn_reset(stmt);
+			if (KSQL_DONE == rc)
+				break;
+		}
+		if ( ! conn_retry(c, &tries))
+			return -1;
+	}
+
+	/* ksql doesn't give us sqlite3_changes(), so ask the database. */
+
+	if (NULL == (stmt = conn_stmt(c, CSTMT_CHANGES)))
+		return -1;
+	if (KSQL_ROW != ksql_stmt_step(stmt)) {
+		conn_reset(stmt);
+		return -1;
+	}
+	batch = ksql_stmt_int(stmt, 0);
+	conn_reset(stmt);
+	return batch;
+}
+
+static int
+user_update(struct conn *c, enum cstmt id,
+	const char *v, int64_t userid)
+{
+	struct ksqlstmt	*stmt;
+	enum ksqlc	 rc;
+	int		 tries = 0;
+
+	for (;;) {
+		if (NULL != (stmt = conn_stmt(c, id))) {
+			ksql_bind_str(stmt, 0, v);
+			ksql_bind_int(stmt, 1, userid);
+			rc = ksql_stmt_cstep(stmt);
+			conn_reset(stmt);
+			if (KSQL_DONE == rc)
+				break;
+			else if (KSQL_CONSTRAINT == rc)
+				return 0;
+		}
+		if ( ! conn_retry(c, &tries))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Run a user update in the user's shard.
+ * A new e-mail address must also go into the directory, whose unique
+ * addresses catch duplicates across shards, so both are run in a
+ * transaction (see conn_trans_close()): the caller's, if in one,
+ * which the shard joins.
+ * Returns as user_update().
+ */
+static int
+shard_user_update(struct conn *c, enum cstmt id,
+	const char *v, int64_t userid)
+{
+	struct conn	*s;
+	int		 own, rc;
+
+	if (NULL == (s = conn_user(c, userid)))
+		return 0;
+	if (CSTMT_USER_UPDATE_EMAIL != id && ! c->trans)
+		return user_update(s, id, v, userid);
+
+	if ((own = ! c->trans) && ! conn_trans_open(c))
+		return 0;
+	rc = s->trans || conn_trans_open(s);
+	if (rc && CSTMT_USER_UPDATE_EMAIL == id)
+		rc = user_update(c, CSTMT_DIR_UPDATE_EMAIL, v, userid);
+
+	/* The directory can't be put back: roll it all back. */
+
+	if (rc && ! (rc = user_update(s, id, v, userid)) &&
+	    CSTMT_USER_UPDATE_EMAIL == id)
+		c->transerr = 1;
+	if (own)
+		rc = conn_trans_close(c, rc);
+	return rc;
+}
+
+/*
+ * Run one of the two user updates, which bind a string and the user
+ * identifier, in the committer if group commit is enabled.
+ * Returns zero on failure (including constraint violation, such as for
+ * a duplicate e-mail address), non-zero on success.
+ */
+static int
+conn_user_update(struct conn *c, enum cstmt id,
+	const char *v, int64_t userid)
+{
+
+	if (NULL != c->cache)
+		cache_del_user(c->cache, userid);
+
+	if (conn_remote(c)) {
+		if ( ! commit_exec(c->commit, id, userid, 0, NULL, v))
+			return 0;
+	} else if (NULL != c->shards) {
+		if ( ! shard_user_update(c, id, v, userid))
+			return 0;
+	} else if ( ! user_update(c, id, v, userid))
+		return 0;
+
+	if (NULL != c->shm)
+		shmcache_del_user(c->shm, userid);
+	return 1;
+}
+
+/*
+ * Drop a user's sessions from the caches.
+ * Updates in a transaction do so as they run, but must do so again
+ * once it has ended: other processes may have cached the old rows in
+ * the meantime.
+ */
+void
+conn_cache_del_user(struct conn *c, int64_t userid)
+{
+
+	if (NULL != c->cache)
+		cache_del_user(c->cache, userid);
+	if (NULL != c->shm)
+		shmcache_del_user(c->shm, userid);
+}
+
+/*
+ * Like db_user_update_email().
+ */
+int
+conn_user_update_email(struct conn *c, const char *email, int64_t id)
+{
+
+	return conn_user_update(c, CSTMT_USER_UPDATE_EMAIL, email, id);
+}
+
+/*
+ * Like db_user_update_pass(), hashing the password before storing it.
+ */
+int
+conn_user_update_pass(struct conn *c, const char *pass, int64_t id)
+{
+	char	 hash[128];
+
+	if ( ! pass_hash(pass, hash, sizeof(hash)))
+		return 0;
+	return conn_user_update_hash(c, hash, id);
+}
+
+/*
+ * Store an already-hashed password.
+ * The committer uses this so that hashing happens in the worker.
+ */
+int
+conn_user_update_hash(struct conn *c, const char *hash, int64_t id)
+{
+
+	return conn_user_update(c, CSTMT_USER_UPDATE_PASS, hash, id);
+}
@@ -17,34 +17,180 @@
 (function(root) {
 	'use strict';
 
+	/*
+	 * An identical GET is sent again at most this many times while
+	 * the server is overloaded (see send()).
+	 */
+	var QUERY_TRIES = 4;
+
+	/*
+	 * A GET answered this recently (milliseconds) is answered again
+	 * with the same response, unless a form has been sent since.
+	 */
+	var QUERY_REUSE = 2000;
+
+	/*
+	 * Backing off waits a random time up to BACKOFF_BASE, doubling
+	 * with each overloaded response in a row to at most BACKOFF_MAX
+	 * (milliseconds).
+	 */
+	var BACKOFF_BASE = 500;
+	var BACKOFF_MAX = 30000;
+
+	var queries = {}; /* callbacks of GETs in flight by url */
+	var recent = {}; /* time and text of GETs answered by url */
+	var sending = []; /* forms in flight */
+	var hold = 0; /* nothing is sent before this time */
+	var fails = 0; /* overloaded responses in a row */
+
+	/*
+	 * Whether the HTTP status "code" means that the server is
+	 * overloaded (or rate-limiting us).
+	 */
+	function overloaded(code)
+	{
+		return(429 === code || code >= 500);
+	}
+
+	/*
+	 * Hold off all requests after an overloaded response.
+	 * The server's "Retry-After" seconds (if any) are waited for,
+	 * else a random time of the exponential backoff, so that
+	 * clients don't all come back at once.
+	 */
+	function backoff(after)
+	{
+		var wait, max;
+
+		fails++;
+		max = Math.min(BACKOFF_MAX, 
+			BACKOFF_BASE * Math.pow(2, fails - 1));
+		wait = parseInt(after, 10);
+		if (isFinite(wait) && wait > 0)
+			wait = wait * 1000 + Math.random() * BACKOFF_BASE;
+		else
+			wait = Math.random() * max;
+		hold = Math.max(hold, Date.now() + wait);
+	}
+
+	/*
+	 * Send "data" (null for nothing) to "url" with "method" once
+	 * any backoff has passed.
+	 * Invokes "done" with the HTTP status code and response text.
+	 */
+	function send(method, url, data, done)
+	{
+		var wait = hold - Date.now();
+		var xmh;
+
+		if (wait > 0) {
+			setTimeout(function() {
+				send(method, url, data, done);
+			}, wait);
+			return;
+		}
+
+		xmh = new XMLHttpRequest();
+		xmh.onreadystatechange = function() {
+			if (xmh.readyState !== 4)
+				return;
+			if (overloaded(xmh.status))
+				backoff(xmh.getResponseHeader('Retry-After'));
+			else
+				fails = 0;
+			done(xmh.status, xmh.responseText);
+		};
+
+		xmh.open(method, url, true);
+		xmh.send(data);
+	}
+
+	/*
+	 * Send the GET for sendQuery() (or again if overloaded), then
+	 * answer everybody waiting on it.
+	 */
+	function query(url, tries)
+	{
+		send('GET', url, null, function(code, v) {
+			var list, i;
+
+			if (overloaded(code) && tries + 1 < QUERY_TRIES) {
+				query(url, tries + 1);
+				return;
+			}
+			list = queries[url];
+			delete queries[url];
+			if (200 === code)
+				recent[url] = { time: Date.now(), text: v };
+			for (i = 0; i < list.length; i++)
+				if (200 === code && null !== list[i].success)
+					list[i].success(v);
+				else if (200 !== code && null !== list[i].error)
+					list[i].error(code, v);
+		});
+	}
+
 	/*
 	 * Send a GET query to the give url.
 	 * Invokes "setup" before running anything, "error" upon network
 	 * error (with the HTTP error code and response text), and
 	 * success with the response text on 200.
+	 * A query for the same url already in flight isn't sent again,
+	 * but shares its response, as does one just answered.
 	 */
 	function sendQuery(url, setup, error, success) 
 	{
-		var xmh = new XMLHttpRequest();
-		var v;
+		var r;
 
 		if (null !== setup)
 			setup();
 
-		xmh.onreadystatechange = function() {
-			v = xmh.responseText;
-			if (xmh.readyState === 4 && 
-			    xmh.status === 200) {
+		if (recent.hasOwnProperty(url)) {
+			r = recent[url];
+			if (Date.now() - r.time < QUERY_REUSE) {
 				if (null !== success)
-					success(v);
-			} else if (xmh.readyState === 4) {
-				if (null !== error)
-					error(xmh.status, v);
+					success(r.text);
+				return;
 			}
-		};
+			delete recent[url];
+		}
 
-		xmh.open('GET', url, true);
-		xmh.send(null);
+		if (queries.hasOwnProperty(url)) {
+			queries[url].push({ error: error, success: success });
+			return;
+		}
+		queries[url] = [{ error: error, success: success }];
+		query(url, 0);
+	}
+
+	/*
+	 * Send "data" for "form" and invoke the callbacks as for
+	 * sendForm().
+	 * The form isn't sent again while it's in flight, so double
+	 * submits are dropped.
+	 * Forms change what queries return, so recent ones are
+	 * forgotten.
+	 */
+	function sendData(form, method, url, data, setup, error, success) 
+	{
+		if (-1 !== sending.indexOf(form))
+			return(false);
+		sending.push(form);
+		recent = {};
+
+		if (null !== setup)
+			setup(form);
+
+		send(method, url, data, function(code, v) {
+			sending.splice(sending.indexOf(form), 1);
+			recent = {};
+			if (200 === code) {
+				if (null !== success)
+					success(form, v);
+			} else if (null !== error)
+				error(form, code, v);
+		});
+		return(false);
 	}
 
 	/*
@@ -53,30 +199,29 @@
 	 * "error" upon network error (with the form, HTTP error code,
 	 * and response text), and success with the form and response
 	 * text on 200.
+	 * See sendData().
 	 */
 	function sendForm(form, setup, error, success) 
 	{
-		var xmh = new XMLHttpRequest();
-		var v;
+		return(sendData(form, form.method, form.action,
+			new FormData(form), setup, error, success));
+	}
 
-		if (null !== setup)
-			setup(form);
+	/*
+	 * Like sendForm(), but sending the form's fields to batch.json
+	 * with the operations in the "ops" array.
+	 * The error and success callbacks are as for sendForm().
+	 */
+	function sendBatch(form, ops, setup, error, success) 
+	{
+		var data = new FormData(form);
+		var i;
 
-		xmh.onreadystatechange=function() {
-			v = xmh.responseText;
-			if (xmh.readyState === 4 && 
-			    xmh.status === 200) {
-				if (null !== success)
-					success(form, v);
-			} else if (xmh.readyState === 4) {
-				if (null !== error)
-					error(form, xmh.status, v);
-			}
-		};
+		for (i = 0; i < ops.length; i++)
+			data.append('op', ops[i]);
 
-		xmh.open(form.method, form.action, true);
-		xmh.send(new FormData(form));
-		return(false);
+		return(sendData(form, 'POST', '@CGIURI@/batch.json',
+			data, setup, error, success));
 	}
 
 	/*
@@ -264,6 +409,36 @@
 			formError, formSuccessReload));
 	}
 
+	/*
+	 * Submit the form's own page (named by its "data-op" attribute)
+	 * and fetch the index in one batch, then show the user
+	 * information that comes back instead of reloading.
+	 * This function is asynchronous.
+	 */
+	function formBatchProc()
+	{
+		return(sendBatch(this, 
+			[this.getAttribute('data-op'), 'index'],
+			formSetup, formError, formSuccessBatch));
+	}
+
+	/*
+	 * Success of formBatchProc().
+	 * Invokes formSuccess() and resets the form.
+	 */
+	function formSuccessBatch(e, resp)
+	{
+		var res, i;
+
+		formSuccess(e, resp);
+		e.reset();
+		if (null === (res = formParse(resp)))
+			return;
+		for (i = 0; i < res.results.length; i++)
+			if (res.results[i].op === 'index')
+				indexFill(res.results[i].user);
+	}
+
 	/*
 	 * Simply parse a JSON message from the "resp" string.
 	 * Returns null on failure, the object on success.
@@ -320,7 +495,15 @@
 		show('loaded');
 		show('loggedin');
 		hide('login');
-		replcl(document, 'user-email', res.user.email);
+		indexFill(res.user);
+	}
+
+	/*
+	 * Show the information of a logged-in user.
+	 */
+	function indexFill(user)
+	{
+		replcl(document, 'user-email', user.email);
 	}
 
 	/*
@@ -336,8 +519,8 @@
 
 		/* Set all "submit" handlers. */
 
-		find('modpassform').onsubmit = formReloadProc;
-		find('modemailform').onsubmit = formReloadProc;
+		find('modpassform').onsubmit = formBatchProc;
+		find('modemailform').onsubmit = formBatchProc;
 		find('loginform').onsubmit = formReloadProc;
 		find('logoutform').onsubmit = formReloadProc;
 
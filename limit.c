@@ -0,0 +1,305 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/mman.h>
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * A bucket is looked for in this many consecutive slots from where its
+ * key hashes, as in shmcache.c.
+ */
+#define	LIMIT_PROBE	8
+
+/*
+ * What a request costs in a bucket, which gains its rate (requests per
+ * minute) in these every millisecond: so there's no rounding.
+ */
+#define	LIMIT_UNIT	(60 * 1000)
+
+static const char *const limitks[LIMIT__MAX] = {
+	"address", /* LIMIT_ADDR */
+	"email", /* LIMIT_EMAIL */
+};
+
+/*
+ * A token bucket in the shared table.
+ * A zero key marks an empty slot.
+ */
+struct	lslot {
+	uint32_t	 lock;
+	uint32_t	 kind;
+	uint64_t	 key; /* hash of the key */
+	int64_t		 tokens; /* LIMIT_UNIT per request */
+	int64_t		 last; /* monotonic milliseconds of refill */
+};
+
+/*
+ * Header of the mapping, followed by the slots.
+ * The counters are updated atomically.
+ */
+struct	lhead {
+	uint64_t	 seed; /* keys the hash */
+	size_t		 slotsz;
+	struct limitcfg	 cfg[LIMIT__MAX];
+	uint64_t	 limited[LIMIT__MAX]; /* requests refused */
+	uint64_t	 evictions; /* buckets in use pushed out */
+};
+
+/*
+ * Token buckets shared by all processes, each slot locked on its own
+ * while it's looked at.
+ */
+struct	limit {
+	struct lhead	*head;
+	struct lslot	*slots;
+	size_t		 mapsz;
+};
+
+static int64_t
+limit_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * FNV-1a of the kind and key, started from the random seed so that
+ * clients can't choose keys that share buckets.
+ * Never zero, which marks an empty slot.
+ */
+static uint64_t
+limit_hash(const struct limit *l, enum limitk kind, const char *key)
+{
+	uint64_t	 h = l->head->seed ^ kind;
+
+	for ( ; '\0' != *key; key++) {
+		h ^= (unsigned char)*key;
+		h *= 0x100000001b3ULL;
+	}
+	return 0 == h ? 1 : h;
+}
+
+static void
+limit_lock(struct lslot *p)
+{
+	uint32_t	 v;
+
+	for (;;) {
+		v = 0;
+		if (__atomic_compare_exchange_n(&p->lock, &v, 1, 0,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		sched_yield();
+	}
+}
+
+static void
+limit_unlock(struct lslot *p)
+{
+
+	__atomic_store_n(&p->lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Map a table of "slots" buckets (rounded up to a power of two)
+ * refilled as given by the LIMIT__MAX entries of "cfg".
+ * This must be called before forking the processes that share it.
+ * Returns NULL on failure.
+ */
+struct limit *
+limit_alloc(size_t slots, const struct limitcfg *cfg)
+{
+	struct limit	*l;
+	size_t		 sz;
+	void		*p;
+
+	for (sz = LIMIT_PROBE; sz < slots; sz <<= 1)
+		continue;
+
+	if (NULL == (l = calloc(1, sizeof(struct limit))))
+		return NULL;
+
+	l->mapsz = sizeof(struct lhead) + sz * sizeof(struct lslot);
+	p = mmap(NULL, l->mapsz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANON, -1, 0);
+	if (MAP_FAILED == p) {
+		kutil_warn(NULL, NULL, "mmap");
+		free(l);
+		return NULL;
+	}
+
+	/* Anonymous mappings are zeroed: all slots are empty. */
+
+	l->head = p;
+	l->slots = (struct lslot *)(l->head + 1);
+	l->head->slotsz = sz;
+	l->head->seed = (uint64_t)arc4random() << 32 | arc4random();
+	memcpy(l->head->cfg, cfg, sizeof(l->head->cfg));
+	return l;
+}
+
+void
+limit_free(struct limit *l)
+{
+
+	if (NULL == l)
+		return;
+	munmap(l->head, l->mapsz);
+	free(l);
+}
+
+/*
+ * Refill the locked bucket "p" up to now.
+ */
+static void
+limit_refill(const struct limitcfg *cfg, struct lslot *p, int64_t now)
+{
+	int64_t		 max = (int64_t)cfg->burst * LIMIT_UNIT;
+
+	if (now > p->last) {
+		p->tokens += (now - p->last) * cfg->rate;
+		p->last = now;
+	}
+	if (p->tokens > max)
+		p->tokens = max;
+}
+
+/*
+ * Find the bucket of "key" and lock it, or take over the empty or
+ * least recently refilled slot for it, starting it full.
+ * Returns the locked slot.
+ */
+static struct lslot *
+limit_find(struct limit *l, enum limitk kind, uint64_t h, int64_t now)
+{
+	struct lslot	*p, *victim = NULL;
+	size_t		 i;
+
+	for (i = 0; i < LIMIT_PROBE; i++) {
+		p = &l->slots[(h + i) & (l->head->slotsz - 1)];
+		limit_lock(p);
+		if (p->key == h && p->kind == (uint32_t)kind)
+			return p;
+		limit_unlock(p);
+		if (NULL == victim || 0 == p->key ||
+		    (0 != victim->key && p->last < victim->last))
+			victim = p;
+	}
+
+	/* Another process might have changed it since we looked. */
+
+	limit_lock(victim);
+	if (0 != victim->key && now - victim->last < 60 * 1000)
+		__atomic_add_fetch(&l->head->evictions, 1,
+			__ATOMIC_RELAXED);
+	victim->key = h;
+	victim->kind = kind;
+	victim->tokens = (int64_t)l->head->cfg[kind].burst * LIMIT_UNIT;
+	victim->last = now;
+	return victim;
+}
+
+/*
+ * Look at the bucket of "key" of the given kind, taking a request from
+ * it if "take" is set and the bucket isn't empty.
+ * Returns zero if the request may go ahead, otherwise the seconds until
+ * the bucket has a request in it.
+ */
+static time_t
+limit_check(struct limit *l, enum limitk kind, const char *key, int take)
+{
+	const struct limitcfg *cfg = &l->head->cfg[kind];
+	struct lslot	*p;
+	int64_t		 now = limit_now(), need;
+
+	if (0 == cfg->burst)
+		return 0;
+
+	p = limit_find(l, kind, limit_hash(l, kind, key), now);
+	limit_refill(cfg, p, now);
+	if (p->tokens >= LIMIT_UNIT) {
+		if (take)
+			p->tokens -= LIMIT_UNIT;
+		limit_unlock(p);
+		return 0;
+	}
+	need = LIMIT_UNIT - p->tokens;
+	limit_unlock(p);
+
+	__atomic_add_fetch(&l->head->limited[kind], 1, __ATOMIC_RELAXED);
+	if (0 == cfg->rate)
+		return 60;
+	need = (need + (int64_t)cfg->rate * 1000 - 1) /
+		((int64_t)cfg->rate * 1000);
+	return need > 0 ? need : 1;
+}
+
+/*
+ * Take a request from the bucket of "key".
+ * Returns as limit_check().
+ */
+time_t
+limit_take(struct limit *l, enum limitk kind, const char *key)
+{
+
+	return limit_check(l, kind, key, 1);
+}
+
+/*
+ * Whether the bucket of "key" has a request in it, without taking it.
+ * Returns as limit_check().
+ */
+time_t
+limit_peek(struct limit *l, enum limitk kind, const char *key)
+{
+
+	return limit_check(l, kind, key, 0);
+}
+
+/*
+ * Write the counters as the object "limits" in "req".
+ */
+void
+limit_json(const struct limit *l, struct kjsonreq *req)
+{
+	size_t	 i;
+
+	kjson_objp_open(req, "limits");
+	for (i = 0; i < LIMIT__MAX; i++) {
+		kjson_objp_open(req, limitks[i]);
+		kjson_putintp(req, "limited", __atomic_load_n
+			(&l->head->limited[i], __ATOMIC_RELAXED));
+		kjson_obj_close(req);
+	}
+	kjson_putintp(req, "evictions", __atomic_load_n
+		(&l->head->evictions, __ATOMIC_RELAXED));
+	kjson_obj_close(req);
+}
@@ -17,11 +17,13 @@
 #include "config.h"
 
 #include <inttypes.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -30,6 +32,178 @@
 #include <ksql.h>
 
 #include "extern.h"
+#include "server.h"
+#if MICROBENCH || COLDSTART
+# include "bench.h"
+#endif
+
+#if FASTCGI
+/*
+ * Default number of pre-forked FastCGI workers (see -n).
+ * Override with FCGI_WORKERS in the Makefile.
+ */
+# ifndef FCGI_WORKERS
+#  define FCGI_WORKERS 4
+# endif
+# define FCGI_WORKERS_MAX 256
+
+/*
+ * Default session cache size (entries) and lifetime (seconds) for each
+ * FastCGI worker (see -c and -t).
+ * A logout clears only its own worker's cache, so the others honour the
+ * session until it expires from theirs: this is off unless asked for.
+ */
+# define CACHE_SIZE 0
+# define CACHE_TTL 60
+
+/*
+ * Default number of logins that may wait for a password hashing
+ * process when all are busy (see -H and -Q).
+ */
+# define VERIFY_QUEUE 8
+
+/*
+ * Default maximum number of writes committed together and how long
+ * (milliseconds) to wait for them when group commit is enabled (see
+ * -B and -W).
+ */
+# define COMMIT_BATCH 32
+# define COMMIT_WAIT 2
+
+/*
+ * Default number of clients and e-mail addresses whose request rates
+ * are tracked (see -L).
+ */
+# define LIMIT_SIZE 4096
+
+/*
+ * Requests without a session may come in bursts of LIMIT_ADDR_BURST
+ * from each client address, refilled at LIMIT_ADDR_RATE per minute;
+ * logins, likewise for each e-mail address.
+ * A zero burst means no limit.
+ * Override these in the Makefile.
+ */
+# ifndef LIMIT_ADDR_RATE
+#  define LIMIT_ADDR_RATE 60
+# endif
+# ifndef LIMIT_ADDR_BURST
+#  define LIMIT_ADDR_BURST 30
+# endif
+# ifndef LIMIT_EMAIL_RATE
+#  define LIMIT_EMAIL_RATE 6
+# endif
+# ifndef LIMIT_EMAIL_BURST
+#  define LIMIT_EMAIL_BURST 5
+# endif
+
+/*
+ * Run-time configuration of the FastCGI master and its workers.
+ */
+struct	opts {
+	size_t		 workers; /* -n */
+	size_t		 cachesz; /* -c */
+	time_t		 cachettl; /* -t */
+	size_t		 shmsz; /* -S */
+	struct shmcache	*shm; /* shared cache (if -S) */
+	size_t		 hashers; /* -H */
+	size_t		 queue; /* -Q */
+	struct verify	*verify; /* hashing pool (if -H) */
+	size_t		 batch; /* -B */
+	int		 wait; /* -W */
+	struct commit	*commit; /* group commit (if -B or -D) */
+	int		 broker; /* -D */
+	size_t		 limitsz; /* -L */
+	struct limit	*limit; /* rate limits (if -L) */
+	struct metrics	*metrics; /* shared counters */
+};
+
+static const struct limitcfg limits[LIMIT__MAX] = {
+	{ LIMIT_ADDR_RATE, LIMIT_ADDR_BURST }, /* LIMIT_ADDR */
+	{ LIMIT_EMAIL_RATE, LIMIT_EMAIL_BURST }, /* LIMIT_EMAIL */
+};
+#endif
+
+/*
+ * Bearer token for the metrics page, which is disabled (along with
+ * collecting metrics) if empty.
+ * Set with METRICS_KEY in the Makefile.
+ */
+#ifndef METRICS_KEY
+# define METRICS_KEY ""
+#endif
+
+/*
+ * Web-server relative file to which each request is appended as a line
+ * of JSON, if not empty: see accesslog_alloc().
+ * Set with ACCESSLOG in the Makefile.
+ */
+#ifndef ACCESSLOG
+# define ACCESSLOG ""
+#endif
+
+/*
+ * Web-server relative location of the sampled traces (see TRACE in
+ * server.h).
+ * Set with TRACE_FILE in the Makefile.
+ */
+#ifndef TRACE_FILE
+# define TRACE_FILE "/logs/yourprog.trace.json"
+#endif
+
+/*
+ * Bodies expected to be smaller than this (bytes) are never compressed:
+ * for these, gzip's header and the time taken outweigh any saving.
+ */
+#ifndef COMPRESS_MIN
+# define COMPRESS_MIN 1024
+#endif
+
+/*
+ * Most operations run by one batch.json request.
+ */
+#define	BATCH_MAX 8
+
+/*
+ * Read-only copy of the database for the index and session list, if
+ * not empty: see conn_replica().
+ * Set with REPLICA in the Makefile.
+ */
+#ifndef REPLICA
+# define REPLICA ""
+#endif
+
+/*
+ * Databases over which users and their sessions are spread, if not
+ * zero: see conn_shards().
+ * Set with SHARDS in the Makefile.
+ * The replica isn't used with shards.
+ */
+#ifndef SHARDS
+# define SHARDS 0
+#endif
+#if SHARDS > SHARDS_MAX
+# error "SHARDS is too large"
+#endif
+
+/*
+ * Lifetime of a session (seconds) in the database and in the cookie.
+ * Override with SESS_TTL in the Makefile.
+ */
+#ifndef SESS_TTL
+# define SESS_TTL (60 * 60 * 24 * 30)
+#endif
+
+/*
+ * Expired sessions are deleted from among the oldest this many at a
+ * time, each batch being its own short transaction: see
+ * conn_sess_prune().
+ * FastCGI workers run a batch after a request at most every
+ * PRUNE_INTERVAL seconds (or right away if the last batch was full);
+ * the CGI script runs one for one in PRUNE_CHANCE requests.
+ */
+#define PRUNE_BATCH 100
+#define PRUNE_INTERVAL 60
+#define PRUNE_CHANCE 100
 
 /*
  * Start with five pages.
@@ -42,6 +216,9 @@ enum	page {
 	PAGE_LOGOUT,
 	PAGE_USER_MOD_EMAIL,
 	PAGE_USER_MOD_PASS,
+	PAGE_METRICS,
+	PAGE_BATCH,
+	PAGE_SESSIONS,
 	PAGE__MAX
 };
 
@@ -51,8 +228,64 @@ static const char *const pages[PAGE__MAX] = {
 	"logout", /* PAGE_LOGOUT */
 	"usermodemail", /* PAGE_USER_MOD_EMAIL */
 	"usermodpass", /* PAGE_USER_MOD_PASS */
+	"metrics", /* PAGE_METRICS */
+	"batch", /* PAGE_BATCH */
+	"sessions", /* PAGE_SESSIONS */
+};
+
+#if TRACE
+/*
+ * Trace spans of the page handlers.
+ */
+static const char *const sends[PAGE__MAX] = {
+	"sendindex", /* PAGE_INDEX */
+	"sendlogin", /* PAGE_LOGIN */
+	"sendlogout", /* PAGE_LOGOUT */
+	"sendmodemail", /* PAGE_USER_MOD_EMAIL */
+	"sendmodpass", /* PAGE_USER_MOD_PASS */
+	"sendmetrics", /* PAGE_METRICS */
+	"sendbatch", /* PAGE_BATCH */
+	"sendsessions", /* PAGE_SESSIONS */
+};
+#endif
+
+/*
+ * State kept by a FastCGI worker across requests, or by the CGI
+ * process for its one request.
+ * This is each request's "arg".
+ */
+struct	ctx {
+	struct conn	*conn; /* database connection */
+	struct verify	*verify; /* if not NULL, hashing pool */
+	struct metrics	*metrics; /* if not NULL, shared counters */
+	struct limit	*limit; /* if not NULL, rate limits */
+	struct accesslog *alog; /* if not NULL, access log */
+	struct accessent ent; /* access log entry of the request */
+	struct timespec	 start; /* when the request started */
+	struct timespec	 mark; /* when the current phase started */
+	enum khttp	 code; /* status of the response */
+	struct arena	 arena; /* freed after each request */
+	int		 keyed; /* request has a session key */
+	unsigned char	 key[SESS_KEY]; /* session key (if keyed) */
 };
 
+/*
+ * Pages may also be asked for with this suffix, which kcgi doesn't
+ * know, to have the document in CBOR instead of JSON: see cbor.c.
+ */
+#define	CBOR_SUFFIX "cbor"
+#define	CBOR_MIME "application/cbor"
+
+/*
+ * Whether the page was asked for in CBOR.
+ */
+static int
+http_cbor(const struct kreq *r)
+{
+
+	return KMIME__MAX == r->mime && 0 == strcmp(r->suffix, CBOR_SUFFIX);
+}
+
 /*
  * Fill out all HTTP secure headers.
  * Use the existing document's MIME type.
@@ -60,35 +293,359 @@ static const char *const pages[PAGE__MAX] = {
 static void
 http_alloc(struct kreq *r, enum khttp code)
 {
+	struct ctx	*ctx = r->arg;
+
+	if (NULL != ctx)
+		ctx->code = code;
 
 	khttp_head(r, kresps[KRESP_STATUS], 
 		"%s", khttps[code]);
 	khttp_head(r, kresps[KRESP_CONTENT_TYPE], 
-		"%s", kmimetypes[r->mime]);
+		"%s", r->mime < KMIME__MAX ? kmimetypes[r->mime] : 
+		http_cbor(r) ? CBOR_MIME : kmimetypes[KMIME_APP_JSON]);
 	khttp_head(r, "X-Content-Type-Options", "nosniff");
 	khttp_head(r, "X-Frame-Options", "DENY");
 	khttp_head(r, "X-XSS-Protection", "1; mode=block");
 }
 
+/*
+ * Whether the client accepts gzip, going by the q-values of its
+ * Accept-Encoding ("x-gzip" being the same, and "*" standing for an
+ * encoding not listed).
+ * kcgi itself only looks for the string "gzip".
+ */
+static int
+http_gzip(const struct kreq *r)
+{
+	const char	*cp, *end, *p;
+	size_t		 sz;
+	double		 q, gz = -1.0, any = -1.0;
+
+	if (NULL == r->reqmap[KREQU_ACCEPT_ENCODING])
+		return 0;
+
+	for (cp = r->reqmap[KREQU_ACCEPT_ENCODING]->val; ; cp = end) {
+		cp += strspn(cp, " \t,");
+		if ('\0' == *cp)
+			break;
+		end = cp + strcspn(cp, ",");
+		sz = strcspn(cp, " \t;,");
+
+		/* Parameters: we only care for the q-value. */
+
+		q = 1.0;
+		for (p = cp + sz; p < end; p += strcspn(p, ";,")) {
+			p += strspn(p, " \t;");
+			if (('q' == p[0] || 'Q' == p[0]) && '=' == p[1])
+				q = strtod(p + 2, NULL);
+		}
+
+		if ((4 == sz && 0 == strncasecmp(cp, "gzip", 4)) ||
+		    (6 == sz && 0 == strncasecmp(cp, "x-gzip", 6)))
+			gz = q;
+		else if (1 == sz && '*' == *cp)
+			any = q;
+	}
+
+	return gz >= 0.0 ? gz > 0.0 : any > 0.0;
+}
+
+/*
+ * Start the body after the headers, compressing it if the client
+ * accepts it and we expect at least COMPRESS_MIN bytes, "sz".
+ * Responses that might be compressed also say so with "Vary" so that
+ * caches keep them apart.
+ */
+static void
+http_body(struct kreq *r, size_t sz)
+{
+
+	if (sz < COMPRESS_MIN) {
+		khttp_body_compress(r, 0);
+		return;
+	}
+	khttp_head(r, kresps[KRESP_VARY], "Accept-Encoding");
+	khttp_body_compress(r, http_gzip(r));
+}
+
 /*
  * Fill out all headers with http_alloc() then start the HTTP document
  * body (no more headers after this point!)
+ * This is for small or empty bodies, so they're not compressed.
  */
 static void
 http_open(struct kreq *r, enum khttp code)
 {
 
 	http_alloc(r, code);
-	khttp_body(r);
+	http_body(r, 0);
+}
+
+/*
+ * The empty document is constant, so write it directly.
+ */
+static void
+http_emptydoc(struct kreq *r)
+{
+
+	if (http_cbor(r))
+		khttp_write(r, "\xa0", 1);
+	else
+		khttp_write(r, "{}", 2);
+}
+
+/*
+ * A document written as JSON or CBOR, as the page was asked for, with
+ * the same calls.
+ */
+struct	body {
+	int		 cbor;
+	struct kjsonreq	 json;
+	struct cborreq	 cb;
+};
+
+static void
+body_open(struct body *b, struct kreq *r)
+{
+
+	if ((b->cbor = http_cbor(r)))
+		cbor_open(&b->cb, r);
+	else
+		kjson_open(&b->json, r);
+}
+
+static void
+body_close(struct body *b)
+{
+
+	if (b->cbor)
+		cbor_close(&b->cb);
+	else
+		kjson_close(&b->json);
+}
+
+static void
+body_obj_open(struct body *b)
+{
+
+	if (b->cbor)
+		cbor_obj_open(&b->cb);
+	else
+		kjson_obj_open(&b->json);
+}
+
+static void
+body_obj_close(struct body *b)
+{
+
+	if (b->cbor)
+		cbor_obj_close(&b->cb);
+	else
+		kjson_obj_close(&b->json);
+}
+
+static void
+body_arrayp_open(struct body *b, const char *key)
+{
+
+	if (b->cbor)
+		cbor_arrayp_open(&b->cb, key);
+	else
+		kjson_arrayp_open(&b->json, key);
+}
+
+static void
+body_array_close(struct body *b)
+{
+
+	if (b->cbor)
+		cbor_array_close(&b->cb);
+	else
+		kjson_array_close(&b->json);
+}
+
+static void
+body_putboolp(struct body *b, const char *key, int v)
+{
+
+	if (b->cbor)
+		cbor_putboolp(&b->cb, key, v);
+	else
+		kjson_putboolp(&b->json, key, v);
+}
+
+static void
+body_putintp(struct body *b, const char *key, int64_t v)
+{
+
+	if (b->cbor)
+		cbor_putintp(&b->cb, key, v);
+	else
+		kjson_putintp(&b->json, key, v);
+}
+
+static void
+body_putstringp(struct body *b, const char *key, const char *v)
+{
+
+	if (b->cbor)
+		cbor_putstringp(&b->cb, key, v);
+	else
+		kjson_putstringp(&b->json, key, v);
+}
+
+static void
+body_user_obj(struct body *b, const struct user *u)
+{
+
+	if (b->cbor)
+		cbor_user_obj(&b->cb, u);
+	else
+		json_user_obj(&b->json, u);
+}
+
+/*
+ * Microseconds from "from" until now.
+ */
+static uint64_t
+elapsed(const struct timespec *from, struct timespec *now)
+{
+
+	clock_gettime(CLOCK_MONOTONIC, now);
+	return (now->tv_sec - from->tv_sec) * 1000000 +
+		(now->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+ * Start accounting for a request.
+ */
+static void
+begin(struct ctx *ctx)
+{
+
+	clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+	ctx->mark = ctx->start;
+	ctx->code = KHTTP__MAX;
+	ctx->ent.userid = -1;
+	ctx->ent.phases = 0;
+}
+
+/*
+ * End phase "ph" of the request to "page", starting the next.
+ */
+static void
+phase_end(struct ctx *ctx, size_t page, enum mphase ph)
+{
+	struct timespec	 now;
+	uint64_t	 us;
+
+	if (NULL == ctx->metrics && NULL == ctx->alog)
+		return;
+	us = elapsed(&ctx->mark, &now);
+	ctx->mark = now;
+	ctx->ent.us[ph] = us > UINT32_MAX ? UINT32_MAX : us;
+	ctx->ent.phases |= 1U << ph;
+	if (NULL != ctx->metrics)
+		metrics_phase(ctx->metrics, page, ph, us);
+}
+
+/*
+ * End phase "ph" of the request.
+ */
+static void
+phase(struct kreq *r, enum mphase ph)
+{
+
+	phase_end(r->arg, r->page, ph);
+}
+
+/*
+ * Account for a request to "page" with "method" once its response has
+ * been flushed.
+ * This is after khttp_free(), so we don't have the request.
+ */
+static void
+done(struct ctx *ctx, size_t page, enum kmethod method)
+{
+	struct timespec	 now;
+	uint64_t	 us;
+
+#if TRACE
+	trace_finish(page < PAGE__MAX ? pages[page] : "other");
+#endif
+	if (NULL == ctx->metrics && NULL == ctx->alog)
+		return;
+	phase_end(ctx, page, MPHASE_EMIT);
+	us = elapsed(&ctx->start, &now);
+	if (NULL != ctx->metrics)
+		metrics_done(ctx->metrics, page, ctx->code, us);
+	if (NULL == ctx->alog)
+		return;
+	ctx->ent.us[MPHASE_TOTAL] = us > UINT32_MAX ? UINT32_MAX : us;
+	ctx->ent.phases |= 1U << MPHASE_TOTAL;
+	ctx->ent.time = time(NULL);
+	ctx->ent.page = page;
+	ctx->ent.method = method;
+	ctx->ent.code = ctx->code;
+	accesslog_add(ctx->alog, &ctx->ent);
 }
 
+/*
+ * Whether the request has the bearer token METRICS_KEY.
+ * Compares in constant time.
+ */
+static int
+metrics_auth(const struct kreq *r)
+{
+	const char	*cp;
+	size_t		 i, sz = strlen(METRICS_KEY);
+	unsigned char	 diff = 0;
+
+	if (NULL == r->reqmap[KREQU_AUTHORIZATION])
+		return 0;
+	cp = r->reqmap[KREQU_AUTHORIZATION]->val;
+	if (strncasecmp(cp, "Bearer ", 7))
+		return 0;
+	cp += 7;
+	if (strlen(cp) != sz)
+		return 0;
+	for (i = 0; i < sz; i++)
+		diff |= cp[i] ^ METRICS_KEY[i];
+	return 0 == diff;
+}
+
+/*
+ * Counters for all pages since they were started.
+ * This doesn't need a session, but the METRICS_KEY bearer token.
+ * Returns HTTP 200 with the counters, 403 without the token, or 404 if
+ * metrics are disabled.
+ */
 static void
-json_emptydoc(struct kreq *r)
+sendmetrics(struct kreq *r)
 {
 	struct kjsonreq	 req;
+	struct ctx	*ctx = r->arg;
 
+	if (NULL == ctx->metrics) {
+		http_open(r, KHTTP_404);
+		http_emptydoc(r);
+		return;
+	} else if ( ! metrics_auth(r)) {
+		http_open(r, KHTTP_403);
+		http_emptydoc(r);
+		return;
+	}
+
+	/* Every page's counters take at least this much. */
+
+	http_alloc(r, KHTTP_200);
+	khttp_head(r, kresps[KRESP_CACHE_CONTROL], "no-store");
+	http_body(r, (PAGE__MAX + 1) * 512);
 	kjson_open(&req, r);
 	kjson_obj_open(&req);
+	metrics_json(ctx->metrics, &req, pages, PAGE__MAX);
+	if (NULL != ctx->limit)
+		limit_json(ctx->limit, &req);
 	kjson_obj_close(&req);
 	kjson_close(&req);
 }
@@ -103,14 +660,15 @@ static void
 sendmodemail(struct kreq *r, const struct user *u)
 {
 	struct kpair	*kp;
+	struct ctx	*ctx = r->arg;
 
-	if (NULL != (kp = r->fieldmap[VALID_USER_EMAIL])) {
-		db_user_update_email(r->arg, kp->parsed.s, u->id);
+	if (NULL != (kp = r->fieldmap[VALID_USER_EMAIL]) &&
+	    conn_user_update_email(ctx->conn, kp->parsed.s, u->id))
 		http_open(r, KHTTP_200);
-	} else
+	else
 		http_open(r, KHTTP_400);
 
-	json_emptydoc(r);
+	http_emptydoc(r);
 }
 
 /*
@@ -122,83 +680,348 @@ static void
 sendmodpass(struct kreq *r, const struct user *u)
 {
 	struct kpair	*kp;
+	struct ctx	*ctx = r->arg;
 
-	if (NULL != (kp = r->fieldmap[VALID_USER_HASH])) {
-		db_user_update_pass(r->arg, kp->parsed.s, u->id);
+	if (NULL != (kp = r->fieldmap[VALID_USER_HASH]) &&
+	    conn_user_update_pass(ctx->conn, kp->parsed.s, u->id))
 		http_open(r, KHTTP_200);
-	} else
+	else
 		http_open(r, KHTTP_400);
 
-	json_emptydoc(r);
+	http_emptydoc(r);
+}
+
+/*
+ * Whether the If-None-Match value "hdr" lists "etag" or is "*".
+ * Tags are compared weakly, as for GET.
+ */
+static int
+etag_match(const char *hdr, const char *etag)
+{
+	size_t	 sz;
+
+	if (0 == strncmp(etag, "W/", 2))
+		etag += 2;
+	sz = strlen(etag);
+
+	for (;;) {
+		hdr += strspn(hdr, " \t,");
+		if ('\0' == *hdr)
+			return 0;
+		if ('*' == *hdr)
+			return 1;
+		if (0 == strncmp(hdr, "W/", 2))
+			hdr += 2;
+		if (0 == strncmp(hdr, etag, sz) &&
+		    ('\0' == hdr[sz] || ',' == hdr[sz] ||
+		     ' ' == hdr[sz] || '\t' == hdr[sz]))
+			return 1;
+		hdr += strcspn(hdr, ",");
+	}
 }
 
 /*
  * Retrieve user information.
+ * The ETag is made from the user's version, which changes whenever the
+ * user is modified, so clients can revalidate instead of refetching.
+ * Raises HTTP 304 if the client's copy is current.
  * Raises HTTP 200 on success and the JSON of the user.
  */
 static void
 sendindex(struct kreq *r, const struct user *u)
 {
-	struct kjsonreq	 req;
+	struct body	 b;
+	char		 etag[64];
 
-	http_open(r, KHTTP_200);
-	kjson_open(&req, r);
-	kjson_obj_open(&req);
-	json_user_obj(&req, u);
-	kjson_obj_close(&req);
-	kjson_close(&req);
+	snprintf(etag, sizeof(etag), "W/\"%" PRId64 "-%" PRId64 "\"",
+		u->id, u->version);
+
+	if (NULL != r->reqmap[KREQU_IF_NONE_MATCH] &&
+	    etag_match(r->reqmap[KREQU_IF_NONE_MATCH]->val, etag)) {
+		http_alloc(r, KHTTP_304);
+		khttp_head(r, kresps[KRESP_ETAG], "%s", etag);
+		khttp_head(r, kresps[KRESP_CACHE_CONTROL], 
+			"private, no-cache");
+		http_body(r, 0);
+		return;
+	}
+
+	http_alloc(r, KHTTP_200);
+	khttp_head(r, kresps[KRESP_ETAG], "%s", etag);
+	khttp_head(r, kresps[KRESP_CACHE_CONTROL], "private, no-cache");
+	http_body(r, strlen(u->email) + 64);
+	body_open(&b, r);
+	body_obj_open(&b);
+	body_user_obj(&b, u);
+	body_obj_close(&b);
+	body_close(&b);
 }
 
 /*
- * Log in the given user by their e-mail and password.
- * Creates a new session.
- * Returns HTTP 400 if missing parameters, bad user, bad password, etc.
- * Returns HTTP 200 with empty JSON body and cookie headers.
+ * Run the pages named by each "op" field, in order, for one session and
+ * in one transaction: "index", "usermodemail", and "usermodpass", the
+ * latter two taking the same fields as their own pages.
+ * User information reflects the changes made before it.
+ * Group commit is bypassed, as the writes must share the transaction.
+ * Raises HTTP 405 if not a POST.
+ * Raises HTTP 400 if an operation is unknown or there are too many, or
+ * if one fails, in which case nothing is changed.
+ * Raises HTTP 500 if the transaction fails.
+ * Raises HTTP 200 on success.
+ * All but the 405 list the operations that were run and whether each
+ * succeeded: after a failure, the last is the one that failed.
  */
 static void
-sendlogin(struct kreq *r)
+sendbatch(struct kreq *r, const struct user *u)
 {
-	int64_t		 sid, token;
-	struct kpair	*kpi, *kpp;
-	char		 buf[64];
-	struct user	*u;
-	const char	*secure;
+	struct body	 b;
+	struct kpair	*kpe, *kpp;
+	struct user	 nu = *u;
+	struct ctx	*ctx = r->arg;
+	enum page	 ops[BATCH_MAX];
+	int		 oks[BATCH_MAX];
+	char		 hash[128];
+	size_t		 i, j, opsz = 0, run;
+	enum khttp	 code = KHTTP_200;
+	int		 ok = 1;
 
-	if (NULL == (kpi = r->fieldmap[VALID_USER_EMAIL]) ||
-	    NULL == (kpp = r->fieldmap[VALID_USER_HASH])) {
-		http_open(r, KHTTP_400);
-		json_emptydoc(r);
+	if (KMETHOD_POST != r->method) {
+		http_open(r, KHTTP_405);
+		http_emptydoc(r);
 		return;
 	}
 
-	u = db_user_get_creds(r->arg, kpi->parsed.s, kpp->parsed.s);
+	for (i = 0; i < r->fieldsz; i++) {
+		if (strcmp(r->fields[i].key, "op"))
+			continue;
+		for (j = 0; j < PAGE__MAX; j++)
+			if (0 == strcmp(r->fields[i].val, pages[j]))
+				break;
+		if (BATCH_MAX == opsz || (PAGE_INDEX != j &&
+		    PAGE_USER_MOD_EMAIL != j && PAGE_USER_MOD_PASS != j)) {
+			http_open(r, KHTTP_400);
+			http_emptydoc(r);
+			return;
+		}
+		ops[opsz++] = j;
+	}
 
-	if (NULL == u) {
-		http_open(r, KHTTP_400);
-		json_emptydoc(r);
+	kpe = r->fieldmap[VALID_USER_EMAIL];
+	kpp = r->fieldmap[VALID_USER_HASH];
+
+	/* Hash the new password now, not while holding the lock. */
+
+	hash[0] = '\0';
+	for (i = 0; i < opsz; i++)
+		if (PAGE_USER_MOD_PASS == ops[i] && NULL != kpp) {
+			if ( ! pass_hash(kpp->parsed.s, hash, sizeof(hash)))
+				hash[0] = '\0';
+			break;
+		}
+
+	/* 
+	 * With group commit, the transaction is ours and its writes
+	 * bypass the committer; with a broker, it's the broker's.
+	 */
+
+	if ( ! conn_trans_open(ctx->conn)) {
+		http_open(r, KHTTP_500);
+		http_emptydoc(r);
 		return;
-	} 
+	}
 
-	token = arc4random();
-	sid = db_sess_insert(r->arg, u->id, token);
-	kutil_epoch2str
-		(time(NULL) + 60 * 60 * 24 * 365,
-		 buf, sizeof(buf));
-#ifdef SECURE
+	for (run = 0; ok && run < opsz; run++) {
+		switch (ops[run]) {
+		case PAGE_USER_MOD_EMAIL:
+			ok = NULL != kpe && conn_user_update_email
+				(ctx->conn, kpe->parsed.s, nu.id);
+			if (ok) {
+				nu.email = (char *)kpe->parsed.s;
+				nu.version++;
+			}
+			break;
+		case PAGE_USER_MOD_PASS:
+			ok = '\0' != hash[0] && conn_user_update_hash
+				(ctx->conn, hash, nu.id);
+			if (ok)
+				nu.version++;
+			break;
+		default:
+			break;
+		}
+		oks[run] = ok;
+	}
+
+	if ( ! ok) {
+		conn_trans_close(ctx->conn, 0);
+		code = KHTTP_400;
+	} else if ( ! conn_trans_close(ctx->conn, 1))
+		code = KHTTP_500;
+
+	conn_cache_del_user(ctx->conn, nu.id);
+	explicit_bzero(hash, sizeof(hash));
+
+	http_alloc(r, code);
+	khttp_head(r, kresps[KRESP_CACHE_CONTROL], "no-store");
+	http_body(r, (KHTTP_200 == code ? run : 0) * 
+		(strlen(nu.email) + 64));
+	body_open(&b, r);
+	body_obj_open(&b);
+	body_arrayp_open(&b, "results");
+	for (i = 0; i < run; i++) {
+		body_obj_open(&b);
+		body_putstringp(&b, "op", pages[ops[i]]);
+		body_putboolp(&b, "ok", 
+			KHTTP_200 == code ? 1 : oks[i]);
+		if (KHTTP_200 == code && PAGE_INDEX == ops[i])
+			body_user_obj(&b, &nu);
+		body_obj_close(&b);
+	}
+	body_array_close(&b);
+	body_obj_close(&b);
+	body_close(&b);
+}
+
+/*
+ * Where sendsessions() writes each session.
+ */
+struct	sessout {
+	struct body	*b;
+	int64_t		 current; /* identifier of the request's session */
+};
+
+static void
+sendsessions_row(const struct sess *s, void *arg)
+{
+	struct sessout	*o = arg;
+
+	body_obj_open(o->b);
+	body_putintp(o->b, "id", s->id);
+	body_putintp(o->b, "expires", s->expires);
+	body_putboolp(o->b, "current", s->id == o->current);
+	body_obj_close(o->b);
+}
+
+/*
+ * List the user's unexpired sessions, but not their tokens.
+ * Each is written as it's read from the database, so memory use doesn't
+ * grow with the list.
+ * As an error partway can't change the status, the list is followed
+ * by whether it's complete.
+ * Raises HTTP 200 with the list.
+ */
+static void
+sendsessions(struct kreq *r, const struct sess *s)
+{
+	struct body	 b;
+	struct sessout	 o;
+	struct ctx	*ctx = r->arg;
+	int64_t		 rc;
+
+	/* We don't know how long the list is. */
+
+	http_alloc(r, KHTTP_200);
+	khttp_head(r, kresps[KRESP_CACHE_CONTROL], "no-store");
+	http_body(r, COMPRESS_MIN);
+	body_open(&b, r);
+	body_obj_open(&b);
+	body_arrayp_open(&b, "sessions");
+	o.b = &b;
+	o.current = s->id;
+	rc = conn_sess_iterate_user(NULL != ctx->conn->replica ?
+		ctx->conn->replica : ctx->conn, 
+		s->userid, time(NULL), sendsessions_row, &o);
+	body_array_close(&b);
+	body_putboolp(&b, "complete", rc >= 0);
+	body_obj_close(&b);
+	body_close(&b);
+}
+
+/*
+ * Check the user's password, either here or (if configured) in the
+ * hashing pool.
+ * Returns VERIFY_FAIL if the user doesn't exist.
+ */
+static enum verifyc
+login_check(struct ctx *ctx, const char *email, 
+	const char *pass, struct user *u)
+{
+
+	if (NULL == ctx->verify)
+		return conn_user_get_creds(ctx->conn, &ctx->arena,
+			email, pass, u) ? VERIFY_OK : VERIFY_FAIL;
+	if ( ! conn_user_get_email(ctx->conn, &ctx->arena, email, u))
+		return VERIFY_FAIL;
+	return verify_check(ctx->verify, pass, u->hash);
+}
+
+/*
+ * Log in the given user by their e-mail and password.
+ * Creates a new session.
+ * Returns HTTP 400 if missing parameters, bad user, bad password, etc.
+ * Returns HTTP 503 if the password hashing pool is full.
+ * Returns HTTP 200 with empty JSON body and cookie headers.
+ */
+static void
+sendlogin(struct kreq *r)
+{
+	unsigned char	 key[SESS_KEY];
+	struct kpair	*kpi, *kpp;
+	char		 buf[64], hex[SESS_KEYHEX + 1];
+	struct user	 u;
+	size_t		 i;
+	const char	*secure;
+	struct ctx	*ctx = r->arg;
+	time_t		 expires;
+
+	if (NULL == (kpi = r->fieldmap[VALID_USER_EMAIL]) ||
+	    NULL == (kpp = r->fieldmap[VALID_USER_HASH])) {
+		http_open(r, KHTTP_400);
+		http_emptydoc(r);
+		return;
+	}
+
+	switch (login_check(ctx, kpi->parsed.s, kpp->parsed.s, &u)) {
+	case VERIFY_BUSY:
+		khttp_head(r, kresps[KRESP_RETRY_AFTER], "1");
+		http_open(r, KHTTP_503);
+		http_emptydoc(r);
+		return;
+	case VERIFY_FAIL:
+		http_open(r, KHTTP_400);
+		http_emptydoc(r);
+		return;
+	default:
+		break;
+	}
+	ctx->ent.userid = u.id;
+
+	/* The key is all that identifies the session (and its shard). */
+
+	conn_sess_key(ctx->conn, u.id, key);
+	expires = time(NULL) + SESS_TTL;
+	if (-1 == conn_sess_insert(ctx->conn, u.id, key, expires)) {
+		explicit_bzero(key, sizeof(key));
+		http_open(r, KHTTP_500);
+		http_emptydoc(r);
+		return;
+	}
+	for (i = 0; i < SESS_KEY; i++)
+		snprintf(hex + i * 2, 3, "%02x", key[i]);
+	explicit_bzero(key, sizeof(key));
+
+	kutil_epoch2str(expires, buf, sizeof(buf));
+#ifdef SECURE
 	secure = " secure;";
 #else
 	secure = "";
 #endif
 	khttp_head(r, kresps[KRESP_SET_COOKIE],
-		"%s=%" PRId64 ";%s HttpOnly; path=/; expires=%s", 
-		valid_keys[VALID_SESS_TOKEN].name, token, secure, buf);
-	khttp_head(r, kresps[KRESP_SET_COOKIE],
-		"%s=%" PRId64 ";%s HttpOnly; path=/; expires=%s", 
-		valid_keys[VALID_SESS_ID].name, sid, secure, buf);
+		"%s=%s;%s HttpOnly; path=/; expires=%s", 
+		valid_keys[VALID_SESS_TOKEN].name, hex, secure, buf);
+	explicit_bzero(hex, sizeof(hex));
 	http_open(r, KHTTP_200);
-	khttp_body(r);
-	json_emptydoc(r);
-	db_user_free(u);
+	http_emptydoc(r);
 }
 
 /*
@@ -211,6 +1034,7 @@ sendlogout(struct kreq *r, const struct sess *s)
 {
 	const char	*secure;
 	char		 buf[32];
+	struct ctx	*ctx = r->arg;
 
 	kutil_epoch2str(0, buf, sizeof(buf));
 #ifdef SECURE
@@ -222,116 +1046,875 @@ sendlogout(struct kreq *r, const struct sess *s)
 	khttp_head(r, kresps[KRESP_SET_COOKIE],
 		"%s=; path=/;%s HttpOnly; expires=%s", 
 		valid_keys[VALID_SESS_TOKEN].name, secure, buf);
-	khttp_head(r, kresps[KRESP_SET_COOKIE],
-		"%s=; path=/;%s HttpOnly; expires=%s", 
-		valid_keys[VALID_SESS_ID].name, secure, buf);
-	khttp_body(r);
-	json_emptydoc(r);
-	db_sess_delete_id(r->arg, s->id, s->token);
+	http_body(r, 0);
+	http_emptydoc(r);
+	conn_sess_delete_token(ctx->conn, s->token);
+}
+
+static int
+hexdigit(char c)
+{
+
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Read the session key from its cookie, SESS_KEYHEX lowercase
+ * hexadecimal digits, into "key".
+ * Returns zero if there's no cookie or it's malformed.
+ */
+static int
+sesskey(const struct kreq *r, unsigned char *key)
+{
+	const struct kpair *kp;
+	size_t		 i;
+	int		 hi, lo;
+
+	if (NULL == (kp = r->cookiemap[VALID_SESS_TOKEN]) ||
+	    SESS_KEYHEX != kp->valsz)
+		return 0;
+	for (i = 0; i < SESS_KEY; i++) {
+		hi = hexdigit(kp->val[i * 2]);
+		lo = hexdigit(kp->val[i * 2 + 1]);
+		if (-1 == hi || -1 == lo)
+			return 0;
+		key[i] = hi << 4 | lo;
+	}
+	return 1;
+}
+
+/*
+ * Front line of defence: make sure we're a proper method, make sure
+ * we're a page, make sure we're a JSON (or CBOR) file.
+ * Metrics are only in JSON.
+ * Returns zero if the request has already been answered with an error,
+ * non-zero if it should be passed along to dispatch().
+ */
+static int
+validate(struct kreq *r)
+{
+
+	if (KMETHOD_GET != r->method && 
+	    KMETHOD_POST != r->method) {
+		http_open(r, KHTTP_405);
+		return 0;
+	} else if (PAGE__MAX == r->page || 
+	           (KMIME_APP_JSON != r->mime && 
+		    (PAGE_METRICS == r->page || ! http_cbor(r)))) {
+		http_open(r, KHTTP_404);
+		khttp_puts(r, "Page not found.");
+		return 0;
+	}
+
+	return 1;
 }
 
+/*
+ * Turn away requests before any database or hashing work is done for
+ * them: those over the rate limits (if any) and those without a
+ * session key that need one.
+ * Requests without a key are charged to the client's address and
+ * logins also to the e-mail address; requests with one are refused
+ * while their address is over its limit, but only charged if the key
+ * is bad (see dispatch()), so clients behind the same address as a
+ * misbehaving one may still be refused.
+ * Returns zero if the request has been answered, non-zero if it should
+ * be passed along to dispatch().
+ */
+static int
+admit(struct kreq *r)
+{
+	struct ctx	*ctx = r->arg;
+	struct kpair	*kp;
+	time_t		 wait = 0;
+
+	if (PAGE_METRICS == r->page)
+		return 1;
+
+	ctx->keyed = sesskey(r, ctx->key);
+
+	if (NULL != ctx->limit) {
+		wait = ctx->keyed ?
+			limit_peek(ctx->limit, LIMIT_ADDR, r->remote) :
+			limit_take(ctx->limit, LIMIT_ADDR, r->remote);
+		if (0 == wait && PAGE_LOGIN == r->page &&
+		    NULL != (kp = r->fieldmap[VALID_USER_EMAIL]))
+			wait = limit_take(ctx->limit, 
+				LIMIT_EMAIL, kp->parsed.s);
+	}
+
+	if (wait > 0) {
+		khttp_head(r, kresps[KRESP_RETRY_AFTER], 
+			"%lld", (long long)wait);
+		http_open(r, KHTTP_429);
+		http_emptydoc(r);
+	} else if ( ! ctx->keyed && PAGE_LOGIN != r->page) {
+		http_open(r, KHTTP_403);
+		http_emptydoc(r);
+	} else
+		return 1;
+
+	explicit_bzero(ctx->key, sizeof(ctx->key));
+	return 0;
+}
+
+/*
+ * Authorise by session and run the page handler.
+ * This assumes that r->arg is set up and that the request has passed
+ * validate() and admit().
+ */
+static void
+dispatch(struct kreq *r)
+{
+	struct sess	 sess, *s = NULL;
+	struct ctx	*ctx = r->arg;
+	int		 found;
+
+	if (PAGE_METRICS == r->page) {
+		TRACE_BEGIN(sends[r->page]);
+		sendmetrics(r);
+		TRACE_END();
+		phase(r, MPHASE_HANDLER);
+		return;
+	}
+
+	/* 
+	 * Assume we're logging in with a session and grab the session
+	 * from the database.
+	 * This is our first database access.
+	 * Read-only pages may use the replica.
+	 */
+
+	if ( ! ctx->keyed)
+		found = 0;
+	else if (PAGE_INDEX == r->page || PAGE_SESSIONS == r->page)
+		found = conn_sess_get_creds_ro(ctx->conn, 
+			&ctx->arena, ctx->key, time(NULL), &sess);
+	else
+		found = conn_sess_get_creds(ctx->conn, 
+			&ctx->arena, ctx->key, time(NULL), &sess);
+	explicit_bzero(ctx->key, sizeof(ctx->key));
+	if (found) {
+		s = &sess;
+		ctx->ent.userid = s->user.id;
+	} else if (ctx->keyed && NULL != ctx->limit)
+		limit_take(ctx->limit, LIMIT_ADDR, r->remote);
+	phase(r, MPHASE_SESS);
+
+	/* User authorisation. */
+
+	if (PAGE_LOGIN != r->page && NULL == s) {
+		http_open(r, KHTTP_403);
+		http_emptydoc(r);
+		return;
+	}
+
+	TRACE_BEGIN(sends[r->page]);
+	switch (r->page) {
+	case (PAGE_INDEX):
+		sendindex(r, &s->user);
+		break;
+	case (PAGE_LOGIN):
+		sendlogin(r);
+		break;
+	case (PAGE_LOGOUT):
+		sendlogout(r, s);
+		break;
+	case (PAGE_USER_MOD_EMAIL):
+		sendmodemail(r, &s->user);
+		break;
+	case (PAGE_USER_MOD_PASS):
+		sendmodpass(r, &s->user);
+		break;
+	case (PAGE_BATCH):
+		sendbatch(r, &s->user);
+		break;
+	case (PAGE_SESSIONS):
+		sendsessions(r, s);
+		break;
+	default:
+		abort();
+	}
+	TRACE_END();
+
+	phase(r, MPHASE_HANDLER);
+}
+
+#if MICROBENCH
+/*
+ * The microbenchmarks in microbench.c make their own requests and run
+ * them here one at a time as a FastCGI worker would, but without the
+ * socket or kcgi's parsing, and with kcgi's output replaced.
+ */
+static	struct ctx	 mbctx;
+
+/*
+ * Open the database "file" as a worker would, with a session cache of
+ * "cachesz" entries unless zero.
+ * Returns zero on failure, non-zero on success.
+ */
 int
-main(void)
+microbench_open(const char *file, size_t cachesz)
+{
+
+	memset(&mbctx, 0, sizeof(struct ctx));
+	if (NULL == (mbctx.conn = conn_open(file)))
+		return 0;
+	if ((SHARDS > 0 && ! conn_shards(mbctx.conn, SHARDS)) ||
+	    (cachesz > 0 && NULL == (mbctx.conn->cache = 
+	     cache_alloc(cachesz, CACHE_TTL)))) {
+		conn_close(mbctx.conn);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Run the request "r" for "page", timing validate() through dispatch()
+ * with microbench_enter() and microbench_leave().
+ */
+void
+microbench_run(struct kreq *r, const char *page)
+{
+
+	for (r->page = 0; r->page < PAGE__MAX; r->page++)
+		if (0 == strcmp(pages[r->page], page))
+			break;
+	begin(&mbctx);
+	r->arg = &mbctx;
+	microbench_enter();
+	if (validate(r) && admit(r))
+		dispatch(r);
+	microbench_leave(r->page,
+		r->page < PAGE__MAX ? pages[r->page] : NULL);
+	done(&mbctx, r->page, r->method);
+	arena_reset(&mbctx.arena);
+}
+
+void
+microbench_close(void)
 {
+
+	arena_free(&mbctx.arena);
+	conn_close(mbctx.conn);
+}
+#elif FASTCGI
+/*
+ * A single FastCGI worker.
+ * The log handle (opened by the master) and the database connection are
+ * kept open for the lifetime of the worker, not per request.
+ */
+static	volatile sig_atomic_t doterm;
+
+static void
+sig_term(int sig)
+{
+
+	doterm = 1;
+}
+
+static int
+worker(size_t slot, void *arg)
+{
+	struct sigaction sa;
+	sigset_t	 term;
 	struct kreq	 r;
+	struct kfcgi	*fcgi;
+	struct conn	*c;
+	struct ctx	 ctx;
 	enum kcgi_err	 er;
-	struct sess	*s;
+	const struct opts *o = arg;
+	const struct cachestats *cs;
+	time_t		 prune = 0, now;
+	int64_t		 pruned;
+	size_t		 page;
+	enum kmethod	 method;
+
+	er = khttp_fcgi_init(&fcgi, valid_keys, VALID__MAX, 
+		pages, PAGE__MAX, PAGE_INDEX);
+
+	if (KCGI_OK != er) {
+		kutil_warnx(NULL, NULL, "%s", kcgi_strerror(er));
+		return EXIT_FAILURE;
+	}
+
+	/* If brokered, the committer keeps the database and replica. */
+
+	if (o->broker) {
+		if (NULL == (c = conn_broker(o->commit))) {
+			kutil_warnx(NULL, NULL, 
+				"worker %zu: conn_broker", slot);
+			khttp_fcgi_free(fcgi);
+			return EXIT_FAILURE;
+		}
+	} else if (NULL == (c = conn_open(DATADIR "/yourprog.db"))) {
+		kutil_warnx(NULL, NULL, "worker %zu: conn_open", slot);
+		khttp_fcgi_free(fcgi);
+		return EXIT_FAILURE;
+	} else if (SHARDS > 0 && ! conn_shards(c, SHARDS)) {
+		kutil_warnx(NULL, NULL, "worker %zu: conn_shards", slot);
+		conn_close(c);
+		khttp_fcgi_free(fcgi);
+		return EXIT_FAILURE;
+	}
+
+	if ( ! o->broker && 0 == SHARDS && '\0' != REPLICA[0] && 
+	    ! conn_replica(c, REPLICA))
+		kutil_warnx(NULL, NULL, "worker %zu: conn_replica: "
+			"running without replica", slot);
+
+	/* Each worker appends to the log on its own. */
+
+	memset(&ctx, 0, sizeof(struct ctx));
+	if ('\0' != ACCESSLOG[0] && NULL == (ctx.alog = 
+	    accesslog_alloc(ACCESSLOG, pages, PAGE__MAX)))
+		kutil_warnx(NULL, NULL, "worker %zu: accesslog_alloc: "
+			"running without access log", slot);
+
+	/* A shared cache, if given, replaces the per-worker one. */
+
+	if (NULL != o->shm)
+		c->shm = o->shm;
+	else if (o->cachesz > 0 && NULL == 
+	    (c->cache = cache_alloc(o->cachesz, o->cachettl)))
+		kutil_warnx(NULL, NULL, "worker %zu: "
+			"cache_alloc: running uncached", slot);
+
+	ctx.conn = c;
+	ctx.metrics = o->metrics;
+	ctx.limit = o->limit;
+	if (NULL != (ctx.verify = o->verify))
+		verify_worker(ctx.verify, slot);
+	if (NULL != (c->commit = o->commit))
+		commit_worker(c->commit, slot);
+
+#if TRACE
+	if ( ! trace_open(TRACE_FILE))
+		kutil_warnx(NULL, NULL, "worker %zu: trace_open: "
+			"running without traces", slot);
+#endif
+
+	/*
+	 * SQLite runs in this process: it locks the database, writes
+	 * its journal, and reopens it (and opens shards) as needed.
+	 * If brokered, it runs in the committer, and we're left with
+	 * our sockets and the descriptors passed to them.
+	 */
+
+#if HAVE_PLEDGE
+	if (-1 == pledge(o->broker ? "stdio recvfd" :
+	    "stdio rpath cpath wpath flock recvfd", NULL)) {
+		kutil_warn(NULL, NULL, "pledge");
+		accesslog_free(ctx.alog);
+		conn_close(c);
+		khttp_fcgi_free(fcgi);
+		return EXIT_FAILURE;
+	}
+#endif
+
+	/*
+	 * SIGTERM (say, from the master retiring us on a reload) never
+	 * cuts a request short: it's held off while one is answered, and
+	 * otherwise interrupts waiting for the next, after which we exit.
+	 */
+
+	sigemptyset(&term);
+	sigaddset(&term, SIGTERM);
+	memset(&sa, 0, sizeof(struct sigaction));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sig_term;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGTERM, &sa, NULL);
+
+	while ( ! doterm &&
+	    KCGI_OK == (er = khttp_fcgi_parse(fcgi, &r))) {
+		sigprocmask(SIG_BLOCK, &term, NULL);
+
+		/* 
+		 * We can't time parsing: kcgi doesn't tell us when the
+		 * request arrived, only when it's been parsed.
+		 */
+
+		begin(&ctx);
+		r.arg = &ctx;
+#if TRACE
+		trace_start(NULL);
+#endif
+		if (validate(&r) && admit(&r))
+			dispatch(&r);
+		page = r.page;
+		method = r.method;
+		TRACE_BEGIN("khttp_free");
+		khttp_free(&r);
+		TRACE_END();
+		done(&ctx, page, method);
+		arena_reset(&ctx.arena);
+		sigprocmask(SIG_UNBLOCK, &term, NULL);
+
+		/*
+		 * Log lines are held and written between requests, as
+		 * kcgi gives us no chance to do so while idle.
+		 */
+
+		if (NULL != ctx.alog)
+			accesslog_tick(ctx.alog);
+
+		/* 
+		 * Only the first worker prunes sessions, so workers
+		 * don't compete for the write lock doing so.
+		 */
+
+		if (0 != slot || (now = time(NULL)) < prune)
+			continue;
+		pruned = conn_sess_prune(c, now, PRUNE_BATCH);
+		prune = PRUNE_BATCH == pruned ? 
+			now : now + PRUNE_INTERVAL;
+	}
+
+	if (doterm)
+		er = KCGI_EXIT;
+	if (KCGI_EXIT != er)
+		kutil_warnx(NULL, NULL, "worker %zu: %s", 
+			slot, kcgi_strerror(er));
+
+	if ( ! c->broker)
+		kutil_info(NULL, NULL, "worker %zu: statements: %" 
+			PRIu64 " compiled, %" PRIu64 " reused, %" 
+			PRIu64 " reconnects", slot, c->stats.compiled, 
+			c->stats.reused, c->stats.reconnects);
+
+	if (NULL != c->cache || NULL != c->shm) {
+		cs = NULL != c->shm ? 
+			shmcache_stats(c->shm) : cache_stats(c->cache);
+		kutil_info(NULL, NULL, "worker %zu: cache: %" PRIu64 
+			" hits, %" PRIu64 " misses (%" PRIu64 " expired), "
+			"%" PRIu64 " evictions", slot, cs->hits, 
+			cs->misses, cs->expired, cs->evictions);
+	}
+
+	accesslog_free(ctx.alog);
+#if TRACE
+	trace_close();
+#endif
+	arena_free(&ctx.arena);
+	conn_close(c);
+	khttp_fcgi_free(fcgi);
+	return KCGI_EXIT == er ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Run by the master in each of its children.
+ * The first slots are FastCGI workers; the rest are password hashers.
+ */
+static int
+child(size_t slot, void *arg)
+{
+	const struct opts *o = arg;
+
+	if (slot < o->workers)
+		return worker(slot, arg);
+	if (slot < o->workers + o->hashers)
+		return verify_hasher(o->verify, slot - o->workers);
+	return commit_run(o->commit, DATADIR "/yourprog.db",
+		o->broker ? REPLICA : "");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int		 c, rc;
+	struct opts	 o;
+	const char	*sock = NULL, *pidfile = NULL, *er;
+
+	memset(&o, 0, sizeof(struct opts));
+	o.workers = FCGI_WORKERS;
+	o.cachesz = CACHE_SIZE;
+	o.cachettl = CACHE_TTL;
+	o.queue = VERIFY_QUEUE;
+	o.wait = COMMIT_WAIT;
+	o.limitsz = LIMIT_SIZE;
 
 	kutil_openlog(LOGFILE);
 
 #if HAVE_PLEDGE
-	if (-1 == pledge("stdio rpath cpath wpath flock fattr proc", NULL)) {
+	if (-1 == pledge("stdio rpath cpath wpath flock "
+	    "fattr proc exec recvfd unix sendfd", NULL)) {
 		kutil_warn(NULL, NULL, "pledge");
 		return EXIT_FAILURE;
 	}
 #endif
 
-	er = khttp_parse(&r, valid_keys, VALID__MAX, 
-		pages, PAGE__MAX, PAGE_INDEX);
+	while (-1 != (c = getopt(argc, argv, "B:c:DH:L:n:p:Q:S:s:t:W:")))
+		switch (c) {
+		case 'B':
+			o.batch = strtonum(optarg, 0, 
+				1024, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-B %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			o.cachesz = strtonum(optarg, 0, 
+				1024 * 1024, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-c %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'D':
+			o.broker = 1;
+			break;
+		case 'H':
+			o.hashers = strtonum(optarg, 0, 
+				FCGI_WORKERS_MAX, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-H %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'L':
+			o.limitsz = strtonum(optarg, 0, 
+				1024 * 1024, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-L %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			o.workers = strtonum(optarg, 0, 
+				FCGI_WORKERS_MAX, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-n %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			pidfile = optarg;
+			break;
+		case 'Q':
+			o.queue = strtonum(optarg, 0, 
+				FCGI_WORKERS_MAX, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-Q %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			o.shmsz = strtonum(optarg, 0, 
+				1024 * 1024, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-S %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 't':
+			o.cachettl = strtonum(optarg, 1, 
+				60 * 60 * 24, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-t %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'W':
+			o.wait = strtonum(optarg, 0, 
+				1000, &er);
+			if (NULL != er) {
+				kutil_warnx(NULL, NULL, 
+					"-W %s: %s", optarg, er);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			goto usage;
+		}
 
-	if (KCGI_OK != er) {
-		kutil_warnx(NULL, NULL, "%s", kcgi_strerror(er));
+	/* A reloaded master has its predecessor's socket. */
+
+	if (NULL != sock && ! master_reloaded() && ! master_listen(sock))
+		return EXIT_FAILURE;
+	if (NULL != pidfile && 0 == o.workers) {
+		kutil_warnx(NULL, NULL, "-p requires -n");
+		return EXIT_FAILURE;
+	} else if (NULL != pidfile && ! master_pidfile(pidfile))
+		return EXIT_FAILURE;
+
+	/* The shared cache must exist before we fork. */
+
+	if (o.shmsz > 0 && NULL == 
+	    (o.shm = shmcache_alloc(o.shmsz, o.cachettl)))
+		return EXIT_FAILURE;
+
+	/* 
+	 * The hashing pool and committer need the master to run their
+	 * processes. 
+	 * Like the shared cache, they must be set up before forking.
+	 * A broker is a committer, by default committing each write
+	 * on its own.
+	 */
+
+	if (o.broker && 0 == o.batch)
+		o.batch = 1;
+
+	if (SHARDS > 0 && o.batch > 0) {
+		kutil_warnx(NULL, NULL, "-B and -D can't be used with SHARDS");
+		shmcache_free(o.shm);
+		return EXIT_FAILURE;
+	} else if ((o.hashers > 0 || o.batch > 0) && 0 == o.workers) {
+		kutil_warnx(NULL, NULL, "-H, -B, and -D require -n");
+		shmcache_free(o.shm);
+		return EXIT_FAILURE;
+	} else if (o.hashers > 0 && NULL == (o.verify = 
+	           verify_alloc(o.workers, o.hashers, o.queue))) {
+		shmcache_free(o.shm);
+		return EXIT_FAILURE;
+	} else if (o.batch > 0 && NULL == (o.commit =
+	           commit_alloc(o.workers, o.batch, o.wait))) {
+		verify_free(o.verify);
+		shmcache_free(o.shm);
 		return EXIT_FAILURE;
 	}
 
+	/* Metrics and limits are shared by all workers, but not essential. */
+
+	if ('\0' != METRICS_KEY[0] && NULL ==
+	    (o.metrics = metrics_alloc(NULL, PAGE__MAX + 1)))
+		kutil_warnx(NULL, NULL, "metrics disabled");
+	if (o.limitsz > 0 && NULL ==
+	    (o.limit = limit_alloc(o.limitsz, limits)))
+		kutil_warnx(NULL, NULL, "rate limits disabled");
+
 	/*
-	 * Front line of defence: make sure we're a proper method, make
-	 * sure we're a page, make sure we're a JSON file.
+	 * With no workers, we're the worker: this is for running under
+	 * a process manager like kfcgi(8) that keeps its own pool.
 	 */
 
-	if (KMETHOD_GET != r.method && 
-	    KMETHOD_POST != r.method) {
-		http_open(&r, KHTTP_405);
-		khttp_free(&r);
-		return EXIT_SUCCESS;
-	} else if (PAGE__MAX == r.page || 
-	           KMIME_APP_JSON != r.mime) {
-		http_open(&r, KHTTP_404);
-		khttp_puts(&r, "Page not found.");
-		khttp_free(&r);
-		return EXIT_SUCCESS;
-	}
+	if (0 == o.workers)
+		rc = worker(0, &o);
+	else
+		rc = master_run(o.workers, o.hashers +
+			(NULL != o.commit), child, &o, argv);
 
-	if (NULL == (r.arg = db_open(DATADIR "/yourprog.db"))) {
-		http_open(&r, KHTTP_500);
-		json_emptydoc(&r);
-		khttp_free(&r);
-		return EXIT_SUCCESS;
+	commit_free(o.commit);
+	verify_free(o.verify);
+	shmcache_free(o.shm);
+	metrics_free(o.metrics);
+	limit_free(o.limit);
+	return rc;
+usage:
+	fprintf(stderr, "usage: %s [-D] [-B batch] [-c cachesize] "
+		"[-H hashers] [-L limitsize] [-n workers] [-p pidfile] "
+		"[-Q queue] [-S shmsize] [-s socket] [-t cachettl] "
+		"[-W wait]\n", 
+		getprogname());
+	return EXIT_FAILURE;
+}
+#else
+/*
+ * The log is opened only once something might be logged: requests
+ * turned away by validate() and admit() never are, so they don't pay
+ * for it.
+ * This must be before giving up the right to open files.
+ */
+static void
+logopen(void)
+{
+	static int	 opened;
+
+	if ( ! opened) {
+		kutil_openlog(LOGFILE);
+		opened = 1;
 	}
+}
+
+#if COLDSTART
+/*
+ * When each phase of this run ended, in monotonic microseconds, written
+ * at exit to COLDSTART_FD for yourprog-coldstart (see coldstart.c),
+ * which knows when we were run and when our first byte came.
+ */
+static uint64_t	 coldmarks[CPHASE__MAX];
+
+static void
+coldmark(enum cphase ph)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	coldmarks[ph] = (uint64_t)ts.tv_sec * 1000000 + 
+		ts.tv_nsec / 1000;
+}
+
+static void
+coldexit(void)
+{
+
+	coldmark(CPHASE_EXIT);
+	(void)write(COLDSTART_FD, coldmarks, sizeof(coldmarks));
+}
+#endif
+
+int
+main(void)
+{
+	struct kreq	 r;
+	struct ctx	 ctx;
+	enum kcgi_err	 er;
+	size_t		 page;
+	enum kmethod	 method;
+	int		 admitted;
+
+#if COLDSTART
+	coldmark(CPHASE_MAIN);
+	atexit(coldexit);
+#endif
+	memset(&ctx, 0, sizeof(struct ctx));
+	begin(&ctx);
 
 #if HAVE_PLEDGE
-	if (-1 == pledge("stdio", NULL)) {
+	if (-1 == pledge("stdio rpath cpath wpath flock fattr proc", NULL)) {
+		logopen();
 		kutil_warn(NULL, NULL, "pledge");
-		db_close(r.arg);
-		khttp_free(&r);
 		return EXIT_FAILURE;
 	}
 #endif
 
 	/* 
-	 * Assume we're logging in with a session and grab the session
-	 * from the database.
-	 * This is our first database access.
+	 * Separate CGI processes share metrics through a file, which we
+	 * map while we can still create it.
+	 * Either of these may log.
 	 */
 
-	s = db_sess_get_creds(r.arg,
-		NULL != r.cookiemap[VALID_SESS_ID] ?
-		r.cookiemap[VALID_SESS_ID]->parsed.i : -1,
-		NULL != r.cookiemap[VALID_SESS_TOKEN] ?
-		r.cookiemap[VALID_SESS_TOKEN]->parsed.i : -1);
+	if ('\0' != METRICS_KEY[0] || '\0' != ACCESSLOG[0])
+		logopen();
+	if ('\0' != METRICS_KEY[0] && NULL == (ctx.metrics = 
+	    metrics_alloc(DATADIR "/yourprog.metrics", PAGE__MAX + 1)))
+		kutil_warnx(NULL, NULL, "metrics disabled");
+	if ('\0' != ACCESSLOG[0] && NULL == (ctx.alog = 
+	    accesslog_alloc(ACCESSLOG, pages, PAGE__MAX)))
+		kutil_warnx(NULL, NULL, "access log disabled");
 
-	/* User authorisation. */
+	/* Traced builds are for profiling, so needn't open lazily. */
+
+#if TRACE
+	logopen();
+	trace_start(TRACE_FILE);
+#endif
+	TRACE_BEGIN("khttp_parse");
+	er = khttp_parse(&r, valid_keys, VALID__MAX, 
+		pages, PAGE__MAX, PAGE_INDEX);
+	TRACE_END();
+#if COLDSTART
+	coldmark(CPHASE_PARSE);
+#endif
 
-	if (PAGE_LOGIN != r.page && NULL == s) {
-		http_open(&r, KHTTP_403);
-		json_emptydoc(&r);
-		db_close(r.arg);
+	if (KCGI_OK != er) {
+		logopen();
+		kutil_warnx(NULL, NULL, "%s", kcgi_strerror(er));
+		accesslog_free(ctx.alog);
+		metrics_free(ctx.metrics);
+		return EXIT_FAILURE;
+	}
+
+	r.arg = &ctx;
+	phase(&r, MPHASE_PARSE);
+	page = r.page;
+	method = r.method;
+
+	/* Requests turned away never open the log or database. */
+
+	admitted = validate(&r) && admit(&r);
+#if COLDSTART
+	coldmark(CPHASE_ADMIT);
+#endif
+	if ( ! admitted) {
+		TRACE_BEGIN("khttp_free");
 		khttp_free(&r);
+		TRACE_END();
+		done(&ctx, page, method);
+		accesslog_free(ctx.alog);
+		metrics_free(ctx.metrics);
 		return EXIT_SUCCESS;
 	}
 
-	switch (r.page) {
-	case (PAGE_INDEX):
-		sendindex(&r, &s->user);
-		break;
-	case (PAGE_LOGIN):
-		sendlogin(&r);
-		break;
-	case (PAGE_LOGOUT):
-		sendlogout(&r, s);
-		break;
-	case (PAGE_USER_MOD_EMAIL):
-		sendmodemail(&r, &s->user);
-		break;
-	case (PAGE_USER_MOD_PASS):
-		sendmodpass(&r, &s->user);
-		break;
-	default:
-		abort();
+	logopen();
+
+	/* Nor does the metrics page, which only needs the counters. */
+
+	if (PAGE_METRICS != r.page &&
+	    (NULL == (ctx.conn = conn_open(DATADIR "/yourprog.db")) ||
+	     (SHARDS > 0 && ! conn_shards(ctx.conn, SHARDS)))) {
+		conn_close(ctx.conn);
+		http_open(&r, KHTTP_500);
+		http_emptydoc(&r);
+		TRACE_BEGIN("khttp_free");
+		khttp_free(&r);
+		TRACE_END();
+		done(&ctx, page, method);
+		accesslog_free(ctx.alog);
+		metrics_free(ctx.metrics);
+		return EXIT_SUCCESS;
+	}
+
+	/* Only read-only pages need the replica. */
+
+	if ('\0' != REPLICA[0] && 0 == SHARDS &&
+	    (PAGE_INDEX == r.page || PAGE_SESSIONS == r.page) &&
+	    ! conn_replica(ctx.conn, REPLICA))
+		kutil_warnx(&r, NULL, "conn_replica: "
+			"running without replica");
+	phase(&r, MPHASE_OPEN);
+#if COLDSTART
+	coldmark(CPHASE_OPEN);
+#endif
+
+	/*
+	 * As in the FastCGI worker, SQLite runs in this process, but
+	 * only for pages that opened the database.
+	 */
+
+#if HAVE_PLEDGE
+	if (-1 == pledge(NULL != ctx.conn ?
+	    "stdio rpath cpath wpath flock" : "stdio", NULL)) {
+		kutil_warn(NULL, NULL, "pledge");
+		conn_close(ctx.conn);
+		khttp_free(&r);
+		accesslog_free(ctx.alog);
+		return EXIT_FAILURE;
 	}
+#endif
 
-	db_sess_free(s);
-	db_close(r.arg);
+	dispatch(&r);
+#if COLDSTART
+	coldmark(CPHASE_HANDLER);
+#endif
+	TRACE_BEGIN("khttp_free");
 	khttp_free(&r);
+	TRACE_END();
+	done(&ctx, page, method);
+
+	if (NULL != ctx.conn && 0 == arc4random_uniform(PRUNE_CHANCE))
+		conn_sess_prune(ctx.conn, time(NULL), PRUNE_BATCH);
+
+	arena_free(&ctx.arena);
+	conn_close(ctx.conn);
+	accesslog_free(ctx.alog);
+	metrics_free(ctx.metrics);
 	return EXIT_SUCCESS;
 }
+#endif /* FASTCGI */
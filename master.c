@@ -0,0 +1,457 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * Don't respawn a worker more than once a second: a worker that can't
+ * start (e.g., a missing database) would otherwise spin.
+ */
+#define	RESPAWN_DELAY	1
+
+/*
+ * A master started by another's reload finds the other's process in
+ * this, so that it may retire it once its own workers are running.
+ */
+#define	MASTER_ENV	"YOURPROG_MASTER"
+
+static	volatile sig_atomic_t doexit;
+static	volatile sig_atomic_t dochild;
+static	volatile sig_atomic_t doreload;
+static	volatile sig_atomic_t doalarm;
+
+static	const char *pidfile;
+
+static void
+sig_exit(int sig)
+{
+
+	doexit = 1;
+}
+
+static void
+sig_child(int sig)
+{
+
+	dochild = 1;
+}
+
+static void
+sig_reload(int sig)
+{
+
+	doreload = 1;
+}
+
+static void
+sig_alarm(int sig)
+{
+
+	doalarm = 1;
+}
+
+/*
+ * Whether we were started by another master's reload, in which case
+ * we've inherited its listening socket.
+ */
+int
+master_reloaded(void)
+{
+
+	return NULL != getenv(MASTER_ENV);
+}
+
+static int
+master_writepid(void)
+{
+	FILE	*f;
+
+	if (NULL == (f = fopen(pidfile, "w"))) {
+		kutil_warn(NULL, NULL, "%s", pidfile);
+		return 0;
+	}
+	fprintf(f, "%d\n", (int)getpid());
+	if (EOF == fclose(f)) {
+		kutil_warn(NULL, NULL, "%s", pidfile);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Write our process to "path" so that we may be sent SIGHUP to reload.
+ * A successor writes it only once it has retired its predecessor.
+ * The file is removed when we exit unless a successor has since written
+ * its own.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+master_pidfile(const char *path)
+{
+
+	pidfile = path;
+	return master_reloaded() ? 1 : master_writepid();
+}
+
+static void
+master_unpidfile(void)
+{
+	FILE	*f;
+	int	 pid;
+
+	if (NULL == pidfile || NULL == (f = fopen(pidfile, "r")))
+		return;
+	if (1 == fscanf(f, "%d", &pid) && pid == (int)getpid())
+		unlink(pidfile);
+	fclose(f);
+}
+
+/*
+ * Bind a listening UNIX socket to "path" and make it our standard
+ * input, which is where FastCGI workers expect their listening socket.
+ * This is for running without a FastCGI manager.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+master_listen(const char *path)
+{
+	struct sockaddr_un	 sun;
+	int			 fd;
+
+	memset(&sun, 0, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= 
+	    sizeof(sun.sun_path)) {
+		kutil_warnx(NULL, NULL, "%s: socket path too long", path);
+		return 0;
+	}
+
+	if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+		kutil_warn(NULL, NULL, "socket");
+		return 0;
+	}
+
+	if (-1 == unlink(path) && ENOENT != errno) {
+		kutil_warn(NULL, NULL, "%s: unlink", path);
+		close(fd);
+		return 0;
+	} else if (-1 == bind(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+		kutil_warn(NULL, NULL, "%s: bind", path);
+		close(fd);
+		return 0;
+	} else if (-1 == listen(fd, SOMAXCONN)) {
+		kutil_warn(NULL, NULL, "%s: listen", path);
+		close(fd);
+		return 0;
+	}
+
+	if (STDIN_FILENO != fd) {
+		if (-1 == dup2(fd, STDIN_FILENO)) {
+			kutil_warn(NULL, NULL, "dup2");
+			close(fd);
+			return 0;
+		}
+		close(fd);
+	}
+
+	return 1;
+}
+
+/*
+ * Start the worker in "slot", recording its process.
+ * The child restores default signal handling then runs the worker
+ * function and exits with its return value.
+ * Returns zero if the fork failed, non-zero otherwise.
+ */
+static int
+master_spawn(pid_t *pids, size_t slot, 
+	int (*fn)(size_t, void *), void *arg, const sigset_t *mask)
+{
+	pid_t	 pid;
+
+	if (-1 == (pid = fork())) {
+		kutil_warn(NULL, NULL, "fork");
+		return 0;
+	} else if (pid > 0) {
+		pids[slot] = pid;
+		return 1;
+	}
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGALRM, SIG_DFL);
+	sigprocmask(SIG_SETMASK, mask, NULL);
+	_exit(fn(slot, arg));
+}
+
+/*
+ * Start our successor: the program in "argv", which is usually a new
+ * binary installed over ours.
+ * It inherits only the listening socket (and the log), not the
+ * descriptors of our committer and hashers, which would otherwise
+ * never see our workers go away.
+ * Returns its process or -1 if the fork failed.
+ */
+static pid_t
+master_exec(char *const *argv, const sigset_t *mask)
+{
+	pid_t	 pid;
+	char	 buf[32];
+	int	 fd;
+
+	if (-1 == (pid = fork())) {
+		kutil_warn(NULL, NULL, "fork");
+		return -1;
+	} else if (pid > 0)
+		return pid;
+
+	for (fd = getdtablesize() - 1; fd > STDERR_FILENO; fd--)
+		close(fd);
+	snprintf(buf, sizeof(buf), "%d", (int)getppid());
+	if (-1 == setenv(MASTER_ENV, buf, 1)) {
+		kutil_warn(NULL, NULL, "setenv");
+		_exit(EXIT_FAILURE);
+	}
+	sigprocmask(SIG_SETMASK, mask, NULL);
+	execvp(argv[0], argv);
+	kutil_warn(NULL, NULL, "%s", argv[0]);
+	_exit(EXIT_FAILURE);
+}
+
+/*
+ * Send SIGTERM to the children in slots "from" up to "to" and reap
+ * them, marking any others that exit meanwhile as gone.
+ */
+static void
+master_stop(pid_t *pids, size_t n, size_t from, size_t to)
+{
+	size_t	 i, live = 0;
+	pid_t	 pid;
+	int	 st;
+
+	for (i = from; i < to; i++)
+		if (pids[i] > 0) {
+			kill(pids[i], SIGTERM);
+			live++;
+		}
+
+	while (live > 0) {
+		if (-1 == (pid = waitpid(-1, &st, 0))) {
+			if (EINTR == errno)
+				continue;
+			break;
+		}
+		for (i = 0; i < n; i++)
+			if (pids[i] == pid) {
+				pids[i] = -1;
+				if (i >= from && i < to)
+					live--;
+			}
+	}
+}
+
+/*
+ * Pre-fork "nworkers" processes and then "nhelpers" more, each running
+ * "fn" with its slot number and "arg", respawning any that exit, until
+ * we get SIGTERM or SIGINT.
+ * At that point, the workers are sent SIGTERM and reaped: each first
+ * finishes the request it's working on.
+ * Only then are the helpers (hashers and the committer), which those
+ * requests may need, stopped in turn.
+ * If "argv" isn't NULL, SIGHUP reloads: a successor is run from "argv"
+ * with our listening socket and, once its workers have run for a while
+ * without failing, sends us SIGTERM.
+ * Should it fail instead, it exits and we keep on.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int
+master_run(size_t nworkers, size_t nhelpers,
+	int (*fn)(size_t, void *), void *arg, char *const *argv)
+{
+	pid_t		*pids;
+	time_t		*starts;
+	size_t		 i, n;
+	pid_t		 pid, next = -1, prev = -1;
+	int		 st, failed = 0, rc = EXIT_SUCCESS;
+	const char	*cp, *er;
+	sigset_t	 block, old;
+	struct sigaction sa;
+
+	n = nworkers + nhelpers;
+	pids = calloc(n, sizeof(pid_t));
+	starts = calloc(n, sizeof(time_t));
+	if (NULL == pids || NULL == starts) {
+		kutil_warn(NULL, NULL, "calloc");
+		free(pids);
+		free(starts);
+		return EXIT_FAILURE;
+	}
+
+	/* Our predecessor, if it's still waiting for us. */
+
+	if (NULL != (cp = getenv(MASTER_ENV))) {
+		prev = strtonum(cp, 1, INT32_MAX, &er);
+		if (NULL != er || prev != getppid())
+			prev = -1;
+		unsetenv(MASTER_ENV);
+	}
+
+	/*
+	 * Block our signals except while waiting in sigsuspend(), so we
+	 * don't lose any between checking the flags and sleeping.
+	 */
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGCHLD);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGALRM);
+	sigprocmask(SIG_BLOCK, &block, &old);
+
+	memset(&sa, 0, sizeof(struct sigaction));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sig_exit;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = sig_child;
+	sigaction(SIGCHLD, &sa, NULL);
+	sa.sa_handler = NULL != argv ? sig_reload : SIG_IGN;
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = sig_alarm;
+	sigaction(SIGALRM, &sa, NULL);
+
+	for (i = 0; i < n; i++) {
+		starts[i] = time(NULL);
+		if ( ! master_spawn(pids, i, fn, arg, &old)) {
+			rc = EXIT_FAILURE;
+			doexit = 1;
+			break;
+		}
+	}
+
+	/*
+	 * Both generations of workers accept from the same socket, so
+	 * there's no moment when nobody is.
+	 * The predecessor is retired only after our workers have had
+	 * time to fail, which they would do at once if the new binary
+	 * can't be run (e.g., it can't open the database).
+	 */
+
+	if (-1 != prev && ! doexit)
+		alarm(RESPAWN_DELAY * 2);
+
+	while ( ! doexit) {
+		sigsuspend(&old);
+		if (doalarm) {
+			doalarm = 0;
+			if (-1 != prev && failed) {
+				kutil_warnx(NULL, NULL, "reload: "
+					"workers failing: exiting");
+				rc = EXIT_FAILURE;
+				doexit = 1;
+			} else if (-1 != prev) {
+				if (NULL != pidfile)
+					master_writepid();
+				kill(prev, SIGTERM);
+				kutil_info(NULL, NULL, "reload: "
+					"retired master (pid %d)", 
+					(int)prev);
+			}
+			prev = -1;
+		}
+		if (doreload) {
+			doreload = 0;
+			if (-1 != next || -1 != prev)
+				kutil_warnx(NULL, NULL, "reload: "
+					"already reloading");
+			else if (-1 != (next = master_exec(argv, &old)))
+				kutil_info(NULL, NULL, "reload: "
+					"started master (pid %d)", 
+					(int)next);
+		}
+		if ( ! dochild)
+			continue;
+		dochild = 0;
+		while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+			if (pid == next) {
+				kutil_warnx(NULL, NULL, "reload: "
+					"master (pid %d) exited", 
+					(int)pid);
+				next = -1;
+				continue;
+			}
+			for (i = 0; i < n; i++)
+				if (pids[i] == pid)
+					break;
+			if (i == n)
+				continue;
+			pids[i] = -1;
+			if ( ! WIFEXITED(st) || EXIT_SUCCESS != WEXITSTATUS(st)) {
+				kutil_warnx(NULL, NULL, "worker %zu "
+					"(pid %d) exited abnormally", 
+					i, (int)pid);
+				failed = 1;
+			}
+			if (doexit)
+				continue;
+			if (time(NULL) - starts[i] < RESPAWN_DELAY)
+				sleep(RESPAWN_DELAY);
+			starts[i] = time(NULL);
+			if ( ! master_spawn(pids, i, fn, arg, &old)) {
+				rc = EXIT_FAILURE;
+				doexit = 1;
+			}
+		}
+	}
+
+	/* 
+	 * Tell the workers to exit and wait for them, then the helpers.
+	 * A successor isn't ours to stop.
+	 */
+
+	alarm(0);
+	master_stop(pids, n, 0, nworkers);
+	master_stop(pids, n, nworkers, n);
+
+	master_unpidfile();
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	free(pids);
+	free(starts);
+	return rc;
+}
@@ -0,0 +1,276 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * Histogram bucket i counts durations of [2^i, 2^(i+1)) microseconds,
+ * except that the first starts at zero and the last has no end.
+ */
+#define	METRICS_BUCKETS	24
+
+/*
+ * Identifies a mapping laid out as below.
+ */
+#define	METRICS_MAGIC	0x6d65747269637301ULL
+
+const char *const mphases[MPHASE__MAX] = {
+	"parse", /* MPHASE_PARSE */
+	"open", /* MPHASE_OPEN */
+	"session", /* MPHASE_SESS */
+	"handler", /* MPHASE_HANDLER */
+	"emit", /* MPHASE_EMIT */
+	"total", /* MPHASE_TOTAL */
+};
+
+struct	mhist {
+	uint64_t	 count;
+	uint64_t	 sum; /* microseconds */
+	uint64_t	 buckets[METRICS_BUCKETS];
+};
+
+struct	mpage {
+	uint64_t	 requests;
+	uint64_t	 status[KHTTP__MAX];
+	struct mhist	 phases[MPHASE__MAX];
+};
+
+/*
+ * Header of the mapping, followed by the pages.
+ * The size is checked along with the magic so that a file left over
+ * from a build with different pages is started over.
+ */
+struct	mhead {
+	uint64_t	 magic;
+	uint64_t	 size;
+	int64_t		 since; /* epoch when started */
+};
+
+/*
+ * Counters shared by all processes, all updated atomically.
+ */
+struct	metrics {
+	struct mhead	*head;
+	struct mpage	*pages;
+	size_t		 pagesz;
+	size_t		 mapsz;
+};
+
+static void
+metrics_add(uint64_t *p, uint64_t v)
+{
+
+	__atomic_add_fetch(p, v, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+metrics_get(const uint64_t *p)
+{
+
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/*
+ * Map counters for "pages" pages.
+ * If "file" is NULL, the mapping is anonymous and must be created
+ * before forking the processes that share it; otherwise, it's the file
+ * (created if needed) so that it's shared by separate CGI processes.
+ * The file is locked while it's sized and its header checked, lest two
+ * processes starting at once map it before it's grown or both set it
+ * up at once.
+ * Returns NULL on failure.
+ */
+struct metrics *
+metrics_alloc(const char *file, size_t pages)
+{
+	struct metrics	*m;
+	struct stat	 st;
+	void		*p;
+	int		 fd = -1;
+
+	if (NULL == (m = calloc(1, sizeof(struct metrics))))
+		return NULL;
+
+	m->pagesz = pages;
+	m->mapsz = sizeof(struct mhead) + pages * sizeof(struct mpage);
+
+	if (NULL == file) {
+		p = mmap(NULL, m->mapsz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANON, -1, 0);
+	} else {
+		if (-1 == (fd = open(file, O_RDWR | O_CREAT, 0600))) {
+			kutil_warn(NULL, NULL, "%s", file);
+			free(m);
+			return NULL;
+		}
+		if (-1 == flock(fd, LOCK_EX) || -1 == fstat(fd, &st) ||
+		    ((size_t)st.st_size != m->mapsz &&
+		     (-1 == ftruncate(fd, 0) ||
+		      -1 == ftruncate(fd, m->mapsz)))) {
+			kutil_warn(NULL, NULL, "%s", file);
+			close(fd);
+			free(m);
+			return NULL;
+		}
+		p = mmap(NULL, m->mapsz, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	}
+
+	if (MAP_FAILED == p) {
+		kutil_warn(NULL, NULL, "mmap");
+		if (-1 != fd)
+			close(fd);
+		free(m);
+		return NULL;
+	}
+
+	m->head = p;
+	m->pages = (struct mpage *)(m->head + 1);
+
+	/* New mappings are zeroed, but old files may not be ours. */
+
+	if (METRICS_MAGIC != m->head->magic ||
+	    m->mapsz != m->head->size) {
+		memset(p, 0, m->mapsz);
+		m->head->since = time(NULL);
+		m->head->size = m->mapsz;
+		m->head->magic = METRICS_MAGIC;
+	}
+
+	/* Closing it releases the lock. */
+
+	if (-1 != fd)
+		close(fd);
+	return m;
+}
+
+void
+metrics_free(struct metrics *m)
+{
+
+	if (NULL == m)
+		return;
+	munmap(m->head, m->mapsz);
+	free(m);
+}
+
+/*
+ * Add "us" microseconds to phase "ph" of page "page".
+ */
+void
+metrics_phase(struct metrics *m, size_t page,
+	enum mphase ph, uint64_t us)
+{
+	struct mhist	*h;
+	uint64_t	 v;
+	size_t		 b;
+
+	if (page >= m->pagesz)
+		return;
+
+	for (b = 0, v = us; v > 1 && b < METRICS_BUCKETS - 1; v >>= 1)
+		b++;
+
+	h = &m->pages[page].phases[ph];
+	metrics_add(&h->count, 1);
+	metrics_add(&h->sum, us);
+	metrics_add(&h->buckets[b], 1);
+}
+
+/*
+ * Finish a request to page "page" that took "us" microseconds in all
+ * and was answered with "code".
+ */
+void
+metrics_done(struct metrics *m, size_t page,
+	enum khttp code, uint64_t us)
+{
+
+	if (page >= m->pagesz)
+		return;
+	metrics_add(&m->pages[page].requests, 1);
+	if (code < KHTTP__MAX)
+		metrics_add(&m->pages[page].status[code], 1);
+	metrics_phase(m, page, MPHASE_TOTAL, us);
+}
+
+/*
+ * Write all counters as a JSON object in "req", naming the pages with
+ * the "namesz" names in "names" and any others "other".
+ * Unused status codes and phases are left out.
+ */
+void
+metrics_json(const struct metrics *m, struct kjsonreq *req,
+	const char *const *names, size_t namesz)
+{
+	const struct mpage *pg;
+	const struct mhist *h;
+	size_t		 i, j, k;
+
+	kjson_putintp(req, "since", m->head->since);
+	kjson_objp_open(req, "pages");
+
+	for (i = 0; i < m->pagesz; i++) {
+		pg = &m->pages[i];
+		kjson_objp_open(req, i < namesz ? names[i] : "other");
+		kjson_putintp(req, "requests", metrics_get(&pg->requests));
+
+		kjson_objp_open(req, "status");
+		for (j = 0; j < KHTTP__MAX; j++)
+			if (metrics_get(&pg->status[j]))
+				kjson_putintp(req, khttps[j],
+					metrics_get(&pg->status[j]));
+		kjson_obj_close(req);
+
+		kjson_objp_open(req, "phases");
+		for (j = 0; j < MPHASE__MAX; j++) {
+			h = &pg->phases[j];
+			if (0 == metrics_get(&h->count))
+				continue;
+			kjson_objp_open(req, mphases[j]);
+			kjson_putintp(req, "count", metrics_get(&h->count));
+			kjson_putintp(req, "sum_us", metrics_get(&h->sum));
+			kjson_arrayp_open(req, "buckets");
+			for (k = 0; k < METRICS_BUCKETS; k++)
+				kjson_putint(req,
+					metrics_get(&h->buckets[k]));
+			kjson_array_close(req);
+			kjson_obj_close(req);
+		}
+		kjson_obj_close(req);
+
+		kjson_obj_close(req);
+	}
+
+	kjson_obj_close(req);
+}
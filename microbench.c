@@ -0,0 +1,470 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+#include "bench.h"
+
+/*
+ * Handler microbenchmarks, run by "make microbench".
+ * We make each request ourselves and pass it to main.c (built with
+ * MICROBENCH) in this process, which calls microbench_enter() and
+ * microbench_leave() around validate() and dispatch() as a FastCGI
+ * worker would.
+ * kcgi's output functions are replaced to keep the response in memory.
+ * So each figure is the cost of the page itself, with neither a socket
+ * nor kcgi's parsing and flushing, and allocations are counted by
+ * wrapping malloc(3) and friends.
+ */
+
+#define	MB_PAGES	16
+
+struct	mbpage {
+	const char	*name;
+	uint64_t	 ops;
+	uint64_t	 ns;
+	uint64_t	 allocs;
+};
+
+static	struct mbpage	 mbpages[MB_PAGES];
+static	struct timespec	 mbstart;
+static	uint64_t	 mballocs;
+static	uint64_t	 allocs; /* calls to allocators */
+
+static	void		*(*real_malloc)(size_t);
+static	void		*(*real_calloc)(size_t, size_t);
+static	void		*(*real_realloc)(void *, size_t);
+static	void		 (*real_free)(void *);
+
+/*
+ * dlsym(3) may allocate (glibc's does), so until we have the real
+ * allocators, allocations come from here and are never freed.
+ */
+static	char		 boot[8192];
+static	size_t		 bootsz;
+static	int		 booting;
+
+static void *
+boot_alloc(size_t sz)
+{
+	void	*p;
+
+	sz = (sz + 15) & ~(size_t)15;
+	if (bootsz + sz > sizeof(boot))
+		return NULL;
+	p = boot + bootsz;
+	bootsz += sz;
+	return p;
+}
+
+static int
+is_boot(const void *p)
+{
+
+	return (const char *)p >= boot &&
+		(const char *)p < boot + sizeof(boot);
+}
+
+/*
+ * Look up the real allocators.
+ * Returns zero while we're doing so, when callers should use the
+ * bootstrap buffer.
+ */
+static int
+hooks_init(void)
+{
+	void	*m, *c, *r, *f;
+
+	if (NULL != real_free)
+		return 1;
+	if (booting)
+		return 0;
+
+	booting = 1;
+	m = dlsym(RTLD_NEXT, "malloc");
+	c = dlsym(RTLD_NEXT, "calloc");
+	r = dlsym(RTLD_NEXT, "realloc");
+	f = dlsym(RTLD_NEXT, "free");
+	if (NULL == m || NULL == c || NULL == r || NULL == f)
+		abort();
+	real_malloc = m;
+	real_calloc = c;
+	real_realloc = r;
+	real_free = f;
+	booting = 0;
+	return 1;
+}
+
+void *
+malloc(size_t sz)
+{
+
+	if ( ! hooks_init())
+		return boot_alloc(sz);
+	allocs++;
+	return real_malloc(sz);
+}
+
+void *
+calloc(size_t n, size_t sz)
+{
+
+	/* The bootstrap buffer is static, so already zeroed. */
+
+	if ( ! hooks_init())
+		return n > 0 && sz > SIZE_MAX / n ?
+			NULL : boot_alloc(n * sz);
+	allocs++;
+	return real_calloc(n, sz);
+}
+
+void *
+realloc(void *p, size_t sz)
+{
+	void	*np;
+	size_t	 max;
+
+	if ( ! hooks_init())
+		return NULL == p ? boot_alloc(sz) : NULL;
+	allocs++;
+	if (NULL == p || ! is_boot(p))
+		return real_realloc(p, sz);
+
+	/* We don't know its size, so copy what's left of the buffer. */
+
+	if (NULL == (np = real_malloc(sz)))
+		return NULL;
+	max = boot + sizeof(boot) - (char *)p;
+	memcpy(np, p, sz < max ? sz : max);
+	return np;
+}
+
+void
+free(void *p)
+{
+
+	if (NULL == p || is_boot(p) || ! hooks_init())
+		return;
+	real_free(p);
+}
+
+void
+microbench_enter(void)
+{
+
+	mballocs = allocs;
+	clock_gettime(CLOCK_MONOTONIC, &mbstart);
+}
+
+/*
+ * Account for a request to page "page" named "name".
+ */
+void
+microbench_leave(size_t page, const char *name)
+{
+	struct timespec	 now;
+	struct mbpage	*p;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	p = &mbpages[page < MB_PAGES ? page : MB_PAGES - 1];
+	p->name = name;
+	p->ops++;
+	p->allocs += allocs - mballocs;
+	p->ns += (uint64_t)(now.tv_sec - mbstart.tv_sec) * 1000000000 +
+		(now.tv_nsec - mbstart.tv_nsec);
+}
+
+/*
+ * The response to the last request, less what doesn't fit, and the
+ * value of the last cookie set, kept by the replacements of kcgi's
+ * output functions below (which kcgijson calls as well).
+ */
+static	char		 out[65536];
+static	size_t		 outsz;
+static	char		 cookie[256];
+
+static void
+out_append(const char *p, size_t sz)
+{
+
+	if (sz > sizeof(out) - outsz)
+		sz = sizeof(out) - outsz;
+	memcpy(out + outsz, p, sz);
+	outsz += sz;
+}
+
+enum kcgi_err
+khttp_head(struct kreq *r, const char *key, const char *fmt, ...)
+{
+	va_list	 ap;
+	char	 buf[1024];
+	int	 c;
+
+	va_start(ap, fmt);
+	c = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (c < 0)
+		return KCGI_SYSTEM;
+	if (0 == strcmp(key, kresps[KRESP_SET_COOKIE]))
+		strlcpy(cookie, buf, sizeof(cookie));
+	out_append(key, strlen(key));
+	out_append(": ", 2);
+	out_append(buf, strlen(buf));
+	out_append("\r\n", 2);
+	return KCGI_OK;
+}
+
+enum kcgi_err
+khttp_body(struct kreq *r)
+{
+
+	out_append("\r\n", 2);
+	return KCGI_OK;
+}
+
+enum kcgi_err
+khttp_body_compress(struct kreq *r, int comp)
+{
+
+	return khttp_body(r);
+}
+
+enum kcgi_err
+khttp_write(struct kreq *r, const char *buf, size_t sz)
+{
+
+	out_append(buf, sz);
+	return KCGI_OK;
+}
+
+enum kcgi_err
+khttp_puts(struct kreq *r, const char *cp)
+{
+
+	out_append(cp, strlen(cp));
+	return KCGI_OK;
+}
+
+enum kcgi_err
+khttp_putc(struct kreq *r, int c)
+{
+	char	 ch = c;
+
+	out_append(&ch, 1);
+	return KCGI_OK;
+}
+
+enum kcgi_err
+khttp_printf(struct kreq *r, const char *fmt, ...)
+{
+	va_list	 ap;
+	char	 buf[1024];
+	int	 c;
+
+	va_start(ap, fmt);
+	c = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (c < 0)
+		return KCGI_SYSTEM;
+	out_append(buf, strlen(buf));
+	return KCGI_OK;
+}
+
+/*
+ * A request as kcgi would have parsed it, with room for one value for
+ * each key.
+ */
+struct	mbreq {
+	struct kreq	 r;
+	struct khead	*reqmap[KREQU__MAX];
+	struct kpair	*cookiemap[VALID__MAX];
+	struct kpair	*cookienmap[VALID__MAX];
+	struct kpair	*fieldmap[VALID__MAX];
+	struct kpair	*fieldnmap[VALID__MAX];
+	struct kpair	 pairs[VALID__MAX];
+	char		 vals[VALID__MAX][128];
+};
+
+static void
+mbreq_init(struct mbreq *q, enum kmethod method)
+{
+
+	memset(q, 0, sizeof(struct mbreq));
+	q->r.reqmap = q->reqmap;
+	q->r.cookiemap = q->cookiemap;
+	q->r.cookienmap = q->cookienmap;
+	q->r.fieldmap = q->fieldmap;
+	q->r.fieldnmap = q->fieldnmap;
+	q->r.method = method;
+	q->r.mime = KMIME_APP_JSON;
+	q->r.suffix = (char *)"json";
+	q->r.remote = (char *)"127.0.0.1";
+	q->r.host = (char *)"localhost";
+	q->r.keys = valid_keys;
+	q->r.keysz = VALID__MAX;
+}
+
+/*
+ * Set the valid cookie or form field (as given by "map") "key".
+ */
+static void
+mbreq_set(struct mbreq *q, struct kpair **map, 
+	size_t key, const char *val)
+{
+	struct kpair	*kp = &q->pairs[key];
+
+	strlcpy(q->vals[key], val, sizeof(q->vals[key]));
+	kp->key = (char *)valid_keys[key].name;
+	kp->val = q->vals[key];
+	kp->valsz = strlen(kp->val);
+	kp->parsed.s = kp->val;
+	kp->state = KPAIR_VALID;
+	kp->type = KPAIR_STRING;
+	map[key] = kp;
+}
+
+static void
+run(struct mbreq *q, const char *page)
+{
+
+	outsz = 0;
+	q->r.pagename = (char *)page;
+	microbench_run(&q->r, page);
+}
+
+/*
+ * Log in as the seeded user, setting the session cookie of "q".
+ * Returns zero on failure.
+ */
+static int
+login(struct mbreq *q)
+{
+	struct mbreq	 lq;
+	size_t		 sz;
+
+	mbreq_init(&lq, KMETHOD_POST);
+	mbreq_set(&lq, lq.fieldmap, 
+		VALID_USER_EMAIL, "bench0@example.com");
+	mbreq_set(&lq, lq.fieldmap, VALID_USER_HASH, BENCH_PASS);
+	cookie[0] = '\0';
+	run(&lq, "login");
+
+	/* The cookie is "name=key; ...". */
+
+	sz = strlen(valid_keys[VALID_SESS_TOKEN].name);
+	if (strncmp(cookie, valid_keys[VALID_SESS_TOKEN].name, sz) ||
+	    '=' != cookie[sz] || ';' == cookie[sz + 1]) {
+		warnx("login failed");
+		return 0;
+	}
+	cookie[sz + 1 + strcspn(cookie + sz + 1, ";")] = '\0';
+	mbreq_set(q, q->cookiemap, VALID_SESS_TOKEN, cookie + sz + 1);
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char	*db = NULL, *er;
+	size_t		 i, n = 2000000, logins = 100, cachesz = 0;
+	const struct mbpage *p;
+	struct mbreq	 q;
+	int		 c, rc = EXIT_FAILURE;
+
+	while (-1 != (c = getopt(argc, argv, "c:D:l:n:")))
+		switch (c) {
+		case 'c':
+			cachesz = strtonum(optarg, 0, 1024 * 1024, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-c %s: %s", optarg, er);
+			break;
+		case 'D':
+			db = optarg;
+			break;
+		case 'l':
+			logins = strtonum(optarg, 0, 1000000, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-l %s: %s", optarg, er);
+			break;
+		case 'n':
+			n = strtonum(optarg, 0, 1000000000, &er);
+			if (NULL != er)
+				errx(EXIT_FAILURE, "-n %s: %s", optarg, er);
+			break;
+		default:
+			goto usage;
+		}
+
+	if (NULL == db)
+		goto usage;
+
+	bench_seed(db, 1);
+	if ( ! microbench_open(db, cachesz))
+		errx(EXIT_FAILURE, "%s: microbench_open", db);
+
+	/*
+	 * All requests come from one address and log in as one user,
+	 * and there are no rate limits.
+	 */
+
+	mbreq_init(&q, KMETHOD_GET);
+	if ( ! login(&q))
+		goto out;
+	for (i = 0; i < n; i++)
+		run(&q, "index");
+	for (i = 0; i < logins; i++) {
+		if ( ! login(&q))
+			goto out;
+		run(&q, "logout");
+	}
+	rc = EXIT_SUCCESS;
+
+	printf("%-14s %10s %10s %10s\n",
+		"page", "requests", "ns/op", "allocs/op");
+	for (i = 0; i < MB_PAGES; i++) {
+		p = &mbpages[i];
+		if (0 == p->ops)
+			continue;
+		printf("%-14s %10" PRIu64 " %10" PRIu64 " %10.1f\n",
+			NULL != p->name ? p->name : "other", p->ops,
+			p->ns / p->ops, (double)p->allocs / p->ops);
+	}
+out:
+	microbench_close();
+	return rc;
+usage:
+	fprintf(stderr, "usage: %s [-c cachesize] [-l logins] "
+		"[-n requests] -D db\n", getprogname());
+	return EXIT_FAILURE;
+}
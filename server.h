@@ -0,0 +1,336 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+ * Hand-written interfaces shared between source files.
+ * The generated database, JSON, and validation interfaces are in
+ * extern.h, which must be included first.
+ */
+
+/*
+ * Bytes of random session key, which (as SESS_KEYHEX hexadecimal
+ * digits) is the session cookie.
+ */
+#define	SESS_KEY	16
+#define	SESS_KEYHEX	(SESS_KEY * 2)
+
+/*
+ * Most databases users may be spread over (see conn_shards()): a
+ * session key names its user's in its last byte.
+ */
+#define	SHARDS_MAX	256
+
+/*
+ * Trace spans (see trace.c) sample one request in TRACE, set in the
+ * Makefile; if zero, they're compiled out.
+ */
+#ifndef TRACE
+# define TRACE 0
+#endif
+#if TRACE
+# define TRACE_BEGIN(_n) trace_begin(_n)
+# define TRACE_END() trace_end()
+#else
+# define TRACE_BEGIN(_n) do { } while (0)
+# define TRACE_END() do { } while (0)
+#endif
+
+/*
+ * Statements prepared once per database connection.
+ * See conn.c.
+ */
+enum	cstmt {
+	CSTMT_CHANGES,
+	CSTMT_DIR_GET,
+	CSTMT_DIR_UPDATE_EMAIL,
+	CSTMT_SESS_CONFIRM,
+	CSTMT_SESS_DELETE_TOKEN,
+	CSTMT_SESS_GET_CREDS,
+	CSTMT_SESS_INSERT,
+	CSTMT_SESS_ITERATE_USER,
+	CSTMT_SESS_PRUNE,
+	CSTMT_USER_GET_CREDS,
+	CSTMT_USER_UPDATE_EMAIL,
+	CSTMT_USER_UPDATE_PASS,
+	CSTMT__MAX
+};
+
+/*
+ * Counters for how well statement reuse is working.
+ */
+struct	connstats {
+	uint64_t	 compiled; /* statements prepared */
+	uint64_t	 reused; /* prepared statements reused */
+	uint64_t	 reconnects; /* reopened after error */
+};
+
+/*
+ * Counters for the session cache.
+ */
+struct	cachestats {
+	uint64_t	 hits;
+	uint64_t	 misses; /* includes expired */
+	uint64_t	 expired; /* found but too old */
+	uint64_t	 evictions; /* pushed out when full */
+};
+
+/*
+ * Result of verify_check().
+ */
+enum	verifyc {
+	VERIFY_OK, /* password matches */
+	VERIFY_FAIL, /* password doesn't match */
+	VERIFY_BUSY /* too many requests or error */
+};
+
+/*
+ * Parts of a request timed for metrics_phase() and the access log.
+ * Their names are in mphases[].
+ */
+enum	mphase {
+	MPHASE_PARSE, /* parsing (CGI only) */
+	MPHASE_OPEN, /* opening the database (CGI only) */
+	MPHASE_SESS, /* looking up the session */
+	MPHASE_HANDLER, /* running the page */
+	MPHASE_EMIT, /* flushing the response */
+	MPHASE_TOTAL, /* all of the above */
+	MPHASE__MAX
+};
+
+/*
+ * A request as written to the access log by accesslog_add().
+ */
+struct	accessent {
+	time_t		 time; /* epoch when finished */
+	size_t		 page;
+	enum kmethod	 method;
+	enum khttp	 code;
+	int64_t		 userid; /* -1 if none */
+	unsigned int	 phases; /* bit for each phase timed */
+	uint32_t	 us[MPHASE__MAX]; /* duration of each */
+};
+
+/*
+ * What limit_take() and limit_peek() count requests by.
+ */
+enum	limitk {
+	LIMIT_ADDR, /* client address */
+	LIMIT_EMAIL, /* login e-mail address */
+	LIMIT__MAX
+};
+
+/*
+ * A token bucket's size and how quickly it refills.
+ * A zero burst means no limit.
+ */
+struct	limitcfg {
+	unsigned int	 rate; /* requests per minute */
+	unsigned int	 burst; /* most requests at once */
+};
+
+struct	ablock;
+struct	accesslog;
+struct	commit;
+struct	kjsonreq;
+struct	limit;
+struct	metrics;
+struct	sesscache;
+struct	shmcache;
+struct	verify;
+
+/*
+ * A CBOR document being written: see cbor.c.
+ */
+struct	cborreq {
+	struct kreq	*r;
+	size_t		 depth; /* maps and arrays open */
+};
+
+/*
+ * Per-request memory, all released by arena_reset().
+ * A zeroed arena is empty and ready for use.
+ * See arena.c.
+ */
+struct	arena {
+	struct ablock	*head;
+	size_t		 size; /* size of new blocks */
+};
+
+/*
+ * A long-lived database connection.
+ * This is the request's "arg" in main.c.
+ */
+struct	conn {
+	struct ksql	 *db;
+	char		 *file;
+	struct ksqlstmt	 *stmts[CSTMT__MAX];
+	struct connstats  stats;
+	struct sesscache *cache; /* if not NULL, session cache */
+	struct shmcache	 *shm; /* if not NULL, shared session cache */
+	struct commit	 *commit; /* if not NULL, writes go here */
+	int		  broker; /* everything goes to commit */
+	struct conn	 *replica; /* if not NULL, for read-only pages */
+	struct conn	**shards; /* if not NULL, hold users and sessions */
+	size_t		  shardsz;
+	int		  ro; /* a replica: see conn_replica() */
+	int		  trans; /* in conn_trans_open() */
+	int		  transerr; /* statement in transaction failed */
+};
+
+__BEGIN_DECLS
+
+extern const char *const mphases[MPHASE__MAX];
+
+void		 accesslog_add(struct accesslog *, const struct accessent *);
+struct accesslog *accesslog_alloc(const char *, 
+			const char *const *, size_t);
+void		 accesslog_flush(struct accesslog *);
+void		 accesslog_free(struct accesslog *);
+void		 accesslog_tick(struct accesslog *);
+
+void		 arena_free(struct arena *);
+void		*arena_malloc(struct arena *, size_t);
+void		 arena_reset(struct arena *);
+void		*arena_memdup(struct arena *, const void *, size_t);
+char		*arena_strdup(struct arena *, const char *);
+
+void		 cbor_array_close(struct cborreq *);
+void		 cbor_arrayp_open(struct cborreq *, const char *);
+void		 cbor_close(struct cborreq *);
+void		 cbor_obj_close(struct cborreq *);
+void		 cbor_obj_open(struct cborreq *);
+void		 cbor_objp_open(struct cborreq *, const char *);
+void		 cbor_open(struct cborreq *, struct kreq *);
+void		 cbor_putbool(struct cborreq *, int);
+void		 cbor_putboolp(struct cborreq *, const char *, int);
+void		 cbor_putint(struct cborreq *, int64_t);
+void		 cbor_putintp(struct cborreq *, const char *, int64_t);
+void		 cbor_putstring(struct cborreq *, const char *);
+void		 cbor_putstringp(struct cborreq *, const char *, 
+			const char *);
+void		 cbor_user_obj(struct cborreq *, const struct user *);
+
+struct sesscache *cache_alloc(size_t, time_t);
+void		 cache_del_sess(struct sesscache *, const unsigned char *);
+void		 cache_del_user(struct sesscache *, int64_t);
+void		 cache_free(struct sesscache *);
+const struct sess *cache_get(struct sesscache *, const unsigned char *);
+void		 cache_put(struct sesscache *, const struct sess *);
+const struct cachestats *cache_stats(const struct sesscache *);
+
+struct shmcache	*shmcache_alloc(size_t, time_t);
+void		 shmcache_del_sess(struct shmcache *, const unsigned char *);
+void		 shmcache_del_user(struct shmcache *, int64_t);
+void		 shmcache_free(struct shmcache *);
+uint64_t	 shmcache_gen(const struct shmcache *);
+int		 shmcache_get(struct shmcache *, struct arena *,
+			const unsigned char *, struct sess *);
+void		 shmcache_put(struct shmcache *, const struct sess *, uint64_t);
+const struct cachestats *shmcache_stats(const struct shmcache *);
+
+struct commit	*commit_alloc(size_t, size_t, int);
+int64_t		 commit_exec(struct commit *, enum cstmt, int64_t,
+			int64_t, const unsigned char *, const char *);
+void		 commit_free(struct commit *);
+int		 commit_run(struct commit *, const char *, const char *);
+int64_t		 commit_sess_iterate(struct commit *, int64_t, time_t,
+			sess_cb, void *);
+int		 commit_sess_get(struct commit *, struct arena *, int,
+			const unsigned char *, time_t, struct sess *);
+int		 commit_trans_close(struct commit *, int);
+int		 commit_trans_open(struct commit *);
+int		 commit_user_get(struct commit *, struct arena *,
+			const char *, struct user *);
+void		 commit_worker(struct commit *, size_t);
+
+struct conn	*conn_broker(struct commit *);
+void		 conn_cache_del_user(struct conn *, int64_t);
+struct conn	*conn_open(const char *);
+int		 conn_replica(struct conn *, const char *);
+void		 conn_close(struct conn *);
+void		 conn_sess_key(const struct conn *, int64_t,
+			unsigned char *);
+int		 conn_shards(struct conn *, size_t);
+int		 conn_sess_delete_token(struct conn *, 
+			const unsigned char *);
+int		 conn_sess_get_creds(struct conn *, struct arena *,
+			const unsigned char *, time_t, struct sess *);
+int		 conn_sess_get_creds_ro(struct conn *, struct arena *,
+			const unsigned char *, time_t, struct sess *);
+int64_t		 conn_sess_insert(struct conn *, int64_t, 
+			const unsigned char *, time_t);
+int64_t		 conn_sess_iterate_user(struct conn *, int64_t, time_t,
+			sess_cb, void *);
+int		 conn_sess_lookup(struct conn *, struct arena *, int,
+			const unsigned char *, time_t, struct sess *);
+int64_t		 conn_sess_prune(struct conn *, time_t, int64_t);
+int		 conn_user_get_creds(struct conn *, struct arena *,
+			const char *, const char *, struct user *);
+int		 conn_user_get_email(struct conn *, struct arena *,
+			const char *, struct user *);
+int		 conn_trans_close(struct conn *, int);
+int		 conn_trans_open(struct conn *);
+int		 conn_user_update_email(struct conn *, 
+			const char *, int64_t);
+int		 conn_user_update_hash(struct conn *, 
+			const char *, int64_t);
+int		 conn_user_update_pass(struct conn *, 
+			const char *, int64_t);
+
+
+struct limit	*limit_alloc(size_t, const struct limitcfg *);
+void		 limit_free(struct limit *);
+void		 limit_json(const struct limit *, struct kjsonreq *);
+time_t		 limit_peek(struct limit *, enum limitk, const char *);
+time_t		 limit_take(struct limit *, enum limitk, const char *);
+
+struct metrics	*metrics_alloc(const char *, size_t);
+void		 metrics_done(struct metrics *, size_t, 
+			enum khttp, uint64_t);
+void		 metrics_free(struct metrics *);
+void		 metrics_json(const struct metrics *, struct kjsonreq *,
+			const char *const *, size_t);
+void		 metrics_phase(struct metrics *, size_t, 
+			enum mphase, uint64_t);
+
+int	 master_listen(const char *);
+int	 master_pidfile(const char *);
+int	 master_reloaded(void);
+int	 master_run(size_t, size_t, int (*)(size_t, void *),
+		void *, char *const *);
+
+int		 pass_check(const char *, const char *);
+int		 pass_hash(const char *, char *, size_t);
+
+void		 trace_begin(const char *);
+void		 trace_close(void);
+void		 trace_end(void);
+void		 trace_finish(const char *);
+int		 trace_open(const char *);
+void		 trace_start(const char *);
+
+struct verify	*verify_alloc(size_t, size_t, size_t);
+enum verifyc	 verify_check(struct verify *, const char *, const char *);
+void		 verify_free(struct verify *);
+int		 verify_hasher(struct verify *, size_t);
+void		 verify_worker(struct verify *, size_t);
+
+__END_DECLS
+
+#endif /* !SERVER_H */
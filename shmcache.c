@@ -0,0 +1,359 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/mman.h>
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * A session is looked for in this many consecutive slots from where it
+ * hashes.
+ * Lookups always scan the whole window, so removal needs no tombstones.
+ */
+#define	SHM_PROBE	8
+
+/*
+ * A slot in the shared table.
+ * Readers copy it out under the sequence number, which is odd while a
+ * writer holds the slot: if the number is odd or changes during the
+ * copy, the reader treats the slot as a miss.
+ * A zero identifier marks an empty slot.
+ */
+struct	shmslot {
+	uint64_t	 seq;
+	int64_t		 id;
+	unsigned char	 key[SESS_KEY];
+	int64_t		 userid;
+	int64_t		 uid; /* user.id */
+	int64_t		 uversion; /* user.version */
+	time_t		 sessexp; /* sess.expires */
+	time_t		 expires; /* monotonic seconds */
+	char		 email[256];
+	char		 hash[128];
+};
+
+/*
+ * Header of the mapping, followed by the slots.
+ * The generation is bumped by every invalidation: see shmcache_put().
+ */
+struct	shmhead {
+	uint64_t	 gen;
+	size_t		 slotsz;
+	time_t		 ttl;
+};
+
+/*
+ * Per-process handle to the mapping.
+ * The counters are per process, as they're copied on fork.
+ */
+struct	shmcache {
+	struct shmhead	 *head;
+	struct shmslot	 *slots;
+	size_t		  mapsz;
+	struct cachestats stats;
+};
+
+static time_t
+shm_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Keys are random, so any of their bits will do for the bucket.
+ */
+static size_t
+shm_bucket(const struct shmcache *c, const unsigned char *key)
+{
+	uint64_t	 h;
+
+	memcpy(&h, key, sizeof(uint64_t));
+	return h & (c->head->slotsz - 1);
+}
+
+/*
+ * Try to take a slot for writing.
+ * If "wait" is set, spin until we get it; otherwise give up if another
+ * writer has it.
+ * Returns the (even) sequence number held before locking or 1 (odd) if
+ * we didn't get the slot.
+ */
+static uint64_t
+shm_lock(struct shmslot *p, int wait)
+{
+	uint64_t	 seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&p->seq, __ATOMIC_SEQ_CST);
+		if ( ! (seq & 1) && __atomic_compare_exchange_n
+		    (&p->seq, &seq, seq + 1, 0,
+		     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return seq;
+		if ( ! wait)
+			return 1;
+		sched_yield();
+	}
+}
+
+static void
+shm_unlock(struct shmslot *p, uint64_t seq)
+{
+
+	__atomic_store_n(&p->seq, seq + 2, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Empty a slot if it still holds the given session.
+ */
+static void
+shm_clear(struct shmslot *p, const unsigned char *key)
+{
+	uint64_t	 seq;
+
+	seq = shm_lock(p, 1);
+	if (0 != p->id && 0 == memcmp(p->key, key, SESS_KEY))
+		p->id = 0;
+	shm_unlock(p, seq);
+}
+
+/*
+ * Map a table of "slots" sessions (rounded up to a power of two) that
+ * live for at most "ttl" seconds.
+ * This must be called before forking the processes that share it.
+ * Returns NULL on failure.
+ */
+struct shmcache *
+shmcache_alloc(size_t slots, time_t ttl)
+{
+	struct shmcache	*c;
+	size_t		 sz;
+	void		*p;
+
+	for (sz = SHM_PROBE; sz < slots; sz <<= 1)
+		continue;
+
+	if (NULL == (c = calloc(1, sizeof(struct shmcache))))
+		return NULL;
+
+	c->mapsz = sizeof(struct shmhead) + sz * sizeof(struct shmslot);
+	p = mmap(NULL, c->mapsz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANON, -1, 0);
+	if (MAP_FAILED == p) {
+		kutil_warn(NULL, NULL, "mmap");
+		free(c);
+		return NULL;
+	}
+
+	/* Anonymous mappings are zeroed: all slots are empty. */
+
+	c->head = p;
+	c->slots = (struct shmslot *)(c->head + 1);
+	c->head->slotsz = sz;
+	c->head->ttl = ttl;
+	return c;
+}
+
+void
+shmcache_free(struct shmcache *c)
+{
+
+	if (NULL == c)
+		return;
+	munmap(c->head, c->mapsz);
+	free(c);
+}
+
+const struct cachestats *
+shmcache_stats(const struct shmcache *c)
+{
+
+	return &c->stats;
+}
+
+/*
+ * The current generation: pass this to shmcache_put() after looking up
+ * the session in the database.
+ */
+uint64_t
+shmcache_gen(const struct shmcache *c)
+{
+
+	return __atomic_load_n(&c->head->gen, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Look up a session without locking, filling in "s" with strings
+ * allocated from "a".
+ * Returns zero on a miss or memory exhaustion, non-zero on a hit.
+ */
+int
+shmcache_get(struct shmcache *c, struct arena *a,
+	const unsigned char *key, struct sess *s)
+{
+	struct shmslot	*p, cp;
+	uint64_t	 seq;
+	size_t		 i, b;
+	time_t		 now = shm_now();
+
+	b = shm_bucket(c, key);
+	for (i = 0; i < SHM_PROBE; i++) {
+		p = &c->slots[(b + i) & (c->head->slotsz - 1)];
+		seq = __atomic_load_n(&p->seq, __ATOMIC_SEQ_CST);
+		if (seq & 1)
+			continue;
+		memcpy(&cp, p, sizeof(struct shmslot));
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (seq != __atomic_load_n(&p->seq, __ATOMIC_SEQ_CST))
+			continue;
+		if (0 == cp.id || memcmp(cp.key, key, SESS_KEY))
+			continue;
+		if (now >= cp.expires) {
+			c->stats.expired++;
+			break;
+		}
+		cp.email[sizeof(cp.email) - 1] = '\0';
+		cp.hash[sizeof(cp.hash) - 1] = '\0';
+		memset(s, 0, sizeof(struct sess));
+		s->id = cp.id;
+		s->token = arena_memdup(a, cp.key, SESS_KEY);
+		s->token_sz = SESS_KEY;
+		s->userid = cp.userid;
+		s->expires = cp.sessexp;
+		s->user.id = cp.uid;
+		s->user.version = cp.uversion;
+		s->user.email = arena_strdup(a, cp.email);
+		s->user.hash = arena_strdup(a, cp.hash);
+		if (NULL == s->token ||
+		    NULL == s->user.email || NULL == s->user.hash)
+			return 0;
+		c->stats.hits++;
+		return 1;
+	}
+
+	c->stats.misses++;
+	return 0;
+}
+
+/*
+ * Add a session read from the database when the generation was "gen".
+ * If there's been an invalidation since then, the session might have
+ * been deleted, so we don't add it.
+ * We check again after adding it for an invalidation that raced with
+ * us: if the invalidation's scan missed our slot, then our check is
+ * guaranteed to see its new generation.
+ * Sessions without a key or with overlong strings aren't cached.
+ */
+void
+shmcache_put(struct shmcache *c, const struct sess *s, uint64_t gen)
+{
+	struct shmslot	*p, *victim = NULL;
+	uint64_t	 seq;
+	size_t		 i, b;
+	time_t		 now = shm_now();
+
+	if (SESS_KEY != s->token_sz ||
+	    strlen(s->user.email) >= sizeof(p->email) ||
+	    strlen(s->user.hash) >= sizeof(p->hash))
+		return;
+	if (shmcache_gen(c) != gen)
+		return;
+
+	/* Prefer an empty or expired slot, else the soonest to expire. */
+
+	b = shm_bucket(c, s->token);
+	for (i = 0; i < SHM_PROBE; i++) {
+		p = &c->slots[(b + i) & (c->head->slotsz - 1)];
+		if (0 == p->id || now >= p->expires) {
+			victim = p;
+			break;
+		}
+		if (NULL == victim || p->expires < victim->expires)
+			victim = p;
+	}
+
+	if (1 == (seq = shm_lock(victim, 0)))
+		return;
+	if (0 != victim->id && now < victim->expires)
+		c->stats.evictions++;
+	victim->id = s->id;
+	memcpy(victim->key, s->token, SESS_KEY);
+	victim->userid = s->userid;
+	victim->uid = s->user.id;
+	victim->uversion = s->user.version;
+	victim->sessexp = s->expires;
+	victim->expires = now + c->head->ttl;
+	strlcpy(victim->email, s->user.email, sizeof(victim->email));
+	strlcpy(victim->hash, s->user.hash, sizeof(victim->hash));
+	shm_unlock(victim, seq);
+
+	if (shmcache_gen(c) != gen)
+		shm_clear(victim, s->token);
+}
+
+/*
+ * Remove a session from all processes' view.
+ * Call this after removing it from the database.
+ */
+void
+shmcache_del_sess(struct shmcache *c, const unsigned char *key)
+{
+	size_t	 i, b;
+
+	__atomic_add_fetch(&c->head->gen, 1, __ATOMIC_SEQ_CST);
+	b = shm_bucket(c, key);
+	for (i = 0; i < SHM_PROBE; i++)
+		shm_clear(&c->slots[(b + i) &
+			(c->head->slotsz - 1)], key);
+}
+
+/*
+ * Remove all of a user's sessions.
+ * Call this after modifying the user in the database.
+ * This scans the whole table, but user modification is rare.
+ */
+void
+shmcache_del_user(struct shmcache *c, int64_t userid)
+{
+	struct shmslot	*p;
+	uint64_t	 seq;
+	size_t		 i;
+
+	__atomic_add_fetch(&c->head->gen, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < c->head->slotsz; i++) {
+		p = &c->slots[i];
+		if (p->userid != userid)
+			continue;
+		seq = shm_lock(p, 1);
+		if (p->userid == userid)
+			p->id = 0;
+		shm_unlock(p, seq);
+	}
+}
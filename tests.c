@@ -39,6 +39,18 @@ main(void)
 	return(0);
 }
 #endif /* TEST_CAPSICUM */
+#if TEST_CRYPT
+#if defined(__linux__)
+# include <crypt.h>
+#endif
+#include <unistd.h>
+
+int
+main(void)
+{
+	return NULL == crypt("abc", "$6$abcdefghijklmnop");
+}
+#endif /* TEST_CRYPT */
 #if TEST_ERR
 /*
  * Copyright (c) 2015 Ingo Schwarze <schwarze@openbsd.org>
@@ -0,0 +1,235 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+#if TRACE
+
+/*
+ * Spans kept for one request, and how deeply they may nest.
+ * Beyond these, spans are left out.
+ */
+#define	TRACE_SPANS	128
+#define	TRACE_DEPTH	16
+
+/*
+ * Longest line written: longer ones are dropped.
+ */
+#define	TRACE_LINE	192
+
+struct	tspan {
+	const char	*name;
+	int64_t		 start; /* epoch microseconds */
+	int64_t		 dur; /* microseconds, or -1 if open */
+};
+
+/*
+ * Spans of the request being traced, if "on", written out together as
+ * Chrome trace events (the JSON array format, which needn't be closed)
+ * once it's done: see trace_finish().
+ * A process runs one request at a time, so there's one of these.
+ */
+static struct {
+	int		 fd;
+	int		 on; /* this request is sampled */
+	int64_t		 start;
+	struct tspan	 spans[TRACE_SPANS];
+	size_t		 spansz;
+	size_t		 open[TRACE_DEPTH]; /* open spans, innermost last */
+	size_t		 depth;
+	size_t		 lost; /* open spans left out */
+	char		 buf[(TRACE_SPANS + 1) * TRACE_LINE];
+} trace = { .fd = -1 };
+
+static int64_t
+trace_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Append traces to "file", starting it with the opening bracket if it's
+ * new (so separate processes needn't agree on who does so).
+ * This must be opened before giving up the right to open files.
+ * Returns zero on failure, non-zero on success (or if already open).
+ */
+int
+trace_open(const char *file)
+{
+	int	 fd;
+
+	if (-1 != trace.fd)
+		return 1;
+
+	fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+	if (-1 != fd) {
+		if (2 != write(fd, "[\n", 2)) {
+			kutil_warn(NULL, NULL, "%s", file);
+			close(fd);
+			return 0;
+		}
+	} else if (EEXIST == errno)
+		fd = open(file, O_WRONLY | O_APPEND);
+
+	if (-1 == fd) {
+		kutil_warn(NULL, NULL, "%s", file);
+		return 0;
+	}
+	trace.fd = fd;
+	return 1;
+}
+
+/*
+ * Start a request, tracing one in TRACE of them.
+ * If "file" isn't NULL, it's opened (as trace_open()) only if this one
+ * is traced; otherwise, it must already have been.
+ */
+void
+trace_start(const char *file)
+{
+
+	trace.spansz = trace.depth = trace.lost = 0;
+	trace.start = trace_now();
+	trace.on = 0 == arc4random_uniform(TRACE) &&
+		(NULL != file ? trace_open(file) : -1 != trace.fd);
+}
+
+/*
+ * Open the span "name" (which must outlive the request) within any
+ * span still open.
+ */
+void
+trace_begin(const char *name)
+{
+	struct tspan	*p;
+
+	if ( ! trace.on)
+		return;
+	if (TRACE_DEPTH == trace.depth || TRACE_SPANS == trace.spansz) {
+		trace.lost++;
+		return;
+	}
+	p = &trace.spans[trace.spansz];
+	p->name = name;
+	p->start = trace_now();
+	p->dur = -1;
+	trace.open[trace.depth++] = trace.spansz++;
+}
+
+/*
+ * Close the innermost span.
+ * Spans left out were opened last, so they're closed first.
+ */
+void
+trace_end(void)
+{
+	struct tspan	*p;
+
+	if ( ! trace.on)
+		return;
+	if (trace.lost > 0) {
+		trace.lost--;
+		return;
+	}
+	if (0 == trace.depth)
+		return;
+	p = &trace.spans[trace.open[--trace.depth]];
+	p->dur = trace_now() - p->start;
+}
+
+/*
+ * Format a span into "buf" of size "sz".
+ * Returns the length or zero if it doesn't fit.
+ */
+static size_t
+trace_line(const char *cat, const char *name,
+	int64_t start, int64_t dur, char *buf, size_t sz)
+{
+	int	 c;
+
+	c = snprintf(buf, sz, "{\"name\":\"%s\",\"cat\":\"%s\","
+		"\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+		"\"pid\":%ld,\"tid\":%ld},\n", name, cat,
+		(long long)start, (long long)dur,
+		(long)getpid(), (long)getpid());
+	return c < 0 || (size_t)c >= sz ? 0 : (size_t)c;
+}
+
+/*
+ * Finish the request, if traced, writing it as a span named "name"
+ * around its own spans (closing any left open) with a single write.
+ */
+void
+trace_finish(const char *name)
+{
+	struct tspan	*p;
+	size_t		 i, len, sz;
+	ssize_t		 ssz;
+	int64_t		 now;
+
+	if ( ! trace.on)
+		return;
+	trace.on = 0;
+	now = trace_now();
+
+	len = trace_line("request", name, trace.start,
+		now - trace.start, trace.buf, TRACE_LINE);
+	for (i = 0; i < trace.spansz; i++) {
+		p = &trace.spans[i];
+		len += trace_line("span", p->name, p->start,
+			-1 == p->dur ? now - p->start : p->dur,
+			trace.buf + len, TRACE_LINE);
+	}
+
+	for (sz = 0; sz < len; sz += ssz)
+		if (-1 == (ssz = write(trace.fd, trace.buf + sz, len - sz))) {
+			if (EINTR == errno) {
+				ssz = 0;
+				continue;
+			}
+			kutil_warn(NULL, NULL, "trace: write");
+			break;
+		}
+}
+
+void
+trace_close(void)
+{
+
+	if (-1 == trace.fd)
+		return;
+	close(trace.fd);
+	trace.fd = -1;
+}
+
+#endif /* TRACE */
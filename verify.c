@@ -0,0 +1,351 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2018 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+
+#include "extern.h"
+#include "server.h"
+
+/*
+ * How long (milliseconds) a worker waits for a hasher to answer before
+ * giving up on the login.
+ */
+#define	VERIFY_TIMEOUT	5000
+
+/*
+ * A request from a worker to a hasher.
+ * Passwords longer than the buffer aren't sent: see verify_check().
+ */
+struct	verifyreq {
+	uint64_t	 seq;
+	char		 pass[256];
+	char		 hash[128];
+};
+
+struct	verifyrep {
+	uint64_t	 seq;
+	int		 ok;
+};
+
+/*
+ * Shared between all processes.
+ * A hasher that dies while hashing never answers: its successor takes
+ * its request off "pending" by way of its flag in "busy".
+ */
+struct	verifyshm {
+	size_t		 pending; /* queued or being hashed */
+	int		 busy[]; /* per hasher: hashing */
+};
+
+/*
+ * The pool of hashing processes.
+ * Each worker slot has a socketpair: the worker writes requests to and
+ * reads answers from its end, and all hashers poll all of the other
+ * ends, with whichever gets a request first answering it.
+ */
+struct	verify {
+	int		 (*fds)[2]; /* per worker: worker, hasher end */
+	size_t		  workers;
+	size_t		  hashers;
+	size_t		  limit; /* maximum pending requests */
+	int		  fd; /* this worker's end or -1 */
+	uint64_t	  seq; /* last request sent by this worker */
+	struct verifyshm *shm;
+};
+
+/*
+ * Create the sockets for "workers" worker slots and the shared request
+ * count, allowing "hashers" requests in progress and another "queue"
+ * waiting.
+ * This must be called before forking.
+ * Returns NULL on failure.
+ */
+struct verify *
+verify_alloc(size_t workers, size_t hashers, size_t queue)
+{
+	struct verify	*v;
+	size_t		 i;
+	void		*p;
+
+	if (NULL == (v = calloc(1, sizeof(struct verify))))
+		return NULL;
+
+	v->fd = -1;
+	v->workers = workers;
+	v->hashers = hashers;
+	v->limit = hashers + queue;
+
+	if (NULL == (v->fds = calloc(workers, sizeof(int[2])))) {
+		free(v);
+		return NULL;
+	}
+	for (i = 0; i < workers; i++)
+		v->fds[i][0] = v->fds[i][1] = -1;
+
+	p = mmap(NULL, sizeof(struct verifyshm) + hashers * sizeof(int),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (MAP_FAILED == p) {
+		kutil_warn(NULL, NULL, "mmap");
+		verify_free(v);
+		return NULL;
+	}
+	v->shm = p;
+
+	for (i = 0; i < workers; i++)
+		if (-1 == socketpair(AF_UNIX,
+		    SOCK_SEQPACKET, 0, v->fds[i])) {
+			kutil_warn(NULL, NULL, "socketpair");
+			v->fds[i][0] = v->fds[i][1] = -1;
+			verify_free(v);
+			return NULL;
+		}
+
+	return v;
+}
+
+void
+verify_free(struct verify *v)
+{
+	size_t	 i;
+
+	if (NULL == v)
+		return;
+	for (i = 0; i < v->workers; i++) {
+		if (-1 != v->fds[i][0])
+			close(v->fds[i][0]);
+		if (-1 != v->fds[i][1])
+			close(v->fds[i][1]);
+	}
+	if (NULL != v->shm)
+		munmap(v->shm, sizeof(struct verifyshm) +
+			v->hashers * sizeof(int));
+	free(v->fds);
+	free(v);
+}
+
+/*
+ * Called by the worker in "slot" after forking.
+ * Closes all descriptors but its own.
+ * A respawned worker takes over the socket of the one it replaced,
+ * along with any answers still on their way to it, so its requests are
+ * numbered from its pid to tell its answers from those.
+ */
+void
+verify_worker(struct verify *v, size_t slot)
+{
+	size_t	 i;
+
+	for (i = 0; i < v->workers; i++) {
+		close(v->fds[i][1]);
+		v->fds[i][1] = -1;
+		if (i == slot)
+			continue;
+		close(v->fds[i][0]);
+		v->fds[i][0] = -1;
+	}
+	v->fd = v->fds[slot][0];
+	v->seq = (uint64_t)getpid() << 32;
+}
+
+/*
+ * Take a request being hashed by hasher "h" off the pending count.
+ * This is done once, by whichever of the hasher (having answered) or
+ * its successor (it having died) clears its flag.
+ */
+static void
+verify_done(struct verify *v, size_t h)
+{
+
+	if (__atomic_exchange_n(&v->shm->busy[h], 0, __ATOMIC_SEQ_CST))
+		__atomic_sub_fetch(&v->shm->pending, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Run hashing process "h" until killed.
+ * Returns EXIT_FAILURE on error.
+ */
+int
+verify_hasher(struct verify *v, size_t h)
+{
+	struct pollfd	 *pfd;
+	struct verifyreq  req;
+	struct verifyrep  rep;
+	size_t		  i;
+	ssize_t		  ssz;
+	int		  rc;
+
+	if (NULL == (pfd = calloc(v->workers, sizeof(struct pollfd)))) {
+		kutil_warn(NULL, NULL, "calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < v->workers; i++) {
+		close(v->fds[i][0]);
+		v->fds[i][0] = -1;
+		pfd[i].fd = v->fds[i][1];
+		pfd[i].events = POLLIN;
+	}
+
+	/* Our predecessor in this slot may have died hashing. */
+
+	verify_done(v, h);
+
+#if HAVE_PLEDGE
+	if (-1 == pledge("stdio", NULL)) {
+		kutil_warn(NULL, NULL, "pledge");
+		free(pfd);
+		return EXIT_FAILURE;
+	}
+#endif
+
+	for (;;) {
+		if (-1 == (rc = poll(pfd, v->workers, INFTIM))) {
+			if (EINTR == errno)
+				continue;
+			kutil_warn(NULL, NULL, "poll");
+			break;
+		}
+		for (i = 0; i < v->workers; i++) {
+			if ( ! (POLLIN & pfd[i].revents))
+				continue;
+
+			/* Another hasher may have taken it. */
+
+			ssz = recv(pfd[i].fd, &req,
+				sizeof(struct verifyreq), MSG_DONTWAIT);
+			if (-1 == ssz &&
+			    (EAGAIN == errno || EINTR == errno))
+				continue;
+			if (ssz != sizeof(struct verifyreq)) {
+				if (ssz > 0)
+					__atomic_sub_fetch(&v->shm->pending,
+						1, __ATOMIC_SEQ_CST);
+				continue;
+			}
+
+			__atomic_store_n(&v->shm->busy[h],
+				1, __ATOMIC_SEQ_CST);
+			req.pass[sizeof(req.pass) - 1] = '\0';
+			req.hash[sizeof(req.hash) - 1] = '\0';
+			rep.seq = req.seq;
+			rep.ok = pass_check(req.pass, req.hash);
+			explicit_bzero(&req, sizeof(struct verifyreq));
+			if (-1 == send(pfd[i].fd, &rep,
+			    sizeof(struct verifyrep), 0))
+				kutil_warn(NULL, NULL, "send");
+			verify_done(v, h);
+		}
+	}
+
+	free(pfd);
+	return EXIT_FAILURE;
+}
+
+/*
+ * Have a hasher check "pass" against "hash".
+ * If the pool already has its maximum number of requests, returns
+ * VERIFY_BUSY without waiting.
+ * A request stops counting against the maximum only once a hasher has
+ * answered it, even if we've stopped waiting for the answer.
+ */
+enum verifyc
+verify_check(struct verify *v, const char *pass, const char *hash)
+{
+	struct verifyreq req;
+	struct verifyrep rep;
+	struct pollfd	 pfd;
+	struct timespec	 start, now;
+	ssize_t		 ssz;
+	int		 ms;
+	enum verifyc	 rc = VERIFY_BUSY;
+
+	if (strlen(pass) >= sizeof(req.pass) ||
+	    strlen(hash) >= sizeof(req.hash))
+		return VERIFY_FAIL;
+
+	if (__atomic_add_fetch(&v->shm->pending, 1,
+	    __ATOMIC_SEQ_CST) > v->limit) {
+		__atomic_sub_fetch(&v->shm->pending, 1, __ATOMIC_SEQ_CST);
+		return VERIFY_BUSY;
+	}
+
+	memset(&req, 0, sizeof(struct verifyreq));
+	req.seq = ++v->seq;
+	strlcpy(req.pass, pass, sizeof(req.pass));
+	strlcpy(req.hash, hash, sizeof(req.hash));
+	ssz = send(v->fd, &req, sizeof(struct verifyreq), 0);
+	explicit_bzero(&req, sizeof(struct verifyreq));
+
+	if (-1 == ssz) {
+		kutil_warn(NULL, NULL, "send");
+		__atomic_sub_fetch(&v->shm->pending, 1, __ATOMIC_SEQ_CST);
+		return VERIFY_BUSY;
+	}
+
+	/*
+	 * Wait for our answer, discarding any that were meant for an
+	 * earlier request that timed out (ours or our predecessor's).
+	 */
+
+	pfd.fd = v->fd;
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = VERIFY_TIMEOUT -
+			((now.tv_sec - start.tv_sec) * 1000 +
+			 (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (ms <= 0) {
+			kutil_warnx(NULL, NULL, "verify: timeout");
+			break;
+		}
+		if (-1 == poll(&pfd, 1, ms)) {
+			if (EINTR == errno)
+				continue;
+			kutil_warn(NULL, NULL, "poll");
+			break;
+		} else if ( ! (POLLIN & pfd.revents))
+			continue;
+		ssz = recv(v->fd, &rep, sizeof(struct verifyrep), 0);
+		if (-1 == ssz) {
+			if (EINTR == errno)
+				continue;
+			kutil_warn(NULL, NULL, "recv");
+			break;
+		} else if (ssz != sizeof(struct verifyrep) ||
+		    rep.seq != v->seq)
+			continue;
+		rc = rep.ok ? VERIFY_OK : VERIFY_FAIL;
+		break;
+	}
+
+	return rc;
+}
@@ -2,35 +2,317 @@
 
 set -e
 
-if [ ! -f "@DATADIR@/yourprog.db" ]
+# With -o, the patch is applied online: see README.md.
+# Large tables are emptied -n rows at a time.
+
+ONLINE=0
+BATCH=1000
+SHARDS=@SHARDS@
+MAIN="@DATADIR@/yourprog.db"
+
+while getopts "n:o" c
+do
+	case "$c" in
+	n)
+		BATCH="$OPTARG"
+		;;
+	o)
+		ONLINE=1
+		;;
+	*)
+		echo "usage: $0 [-o] [-n rows]" 1>&2
+		exit 1
+		;;
+	esac
+done
+
+case "$BATCH" in
+""|*[!0-9]*|0)
+	echo "$0: -n $BATCH: bad row count" 1>&2
+	exit 1
+	;;
+esac
+
+# Users and their sessions may be spread over shards (see SHARDS in the
+# Makefile), each patched like the database.
+# The databases are worked on one at a time as $DB, whose online patch
+# steps are kept next to it.
+
+shard()
+{
+	echo "@DATADIR@/yourprog-$1.db"
+}
+
+dbs()
+{
+	echo "$MAIN"
+	i=0
+	while [ $i -lt $SHARDS ]
+	do
+		shard $i
+		i=`expr $i + 1`
+	done
+}
+
+steps()
+{
+	echo "${DB%.db}-upgrade.sql"
+}
+
+# Run standard input on the database, waiting as the workers do for any
+# write in progress and stopping at the first error (which rolls back
+# any transaction).
+
+dbrun()
+{
+	( echo ".timeout @DB_BUSY@" ; cat ; ) | sqlite3 -bail "$DB"
+}
+
+# Empty the table $1 a batch at a time, letting requests in between,
+# then drop it.
+
+purge()
+{
+	left=`echo "SELECT count(*) FROM $1;" | dbrun`
+	echo "$DB: $1: removing $left rows"
+	while :
+	do
+		gone=`echo "DELETE FROM $1 WHERE rowid IN \
+		  (SELECT rowid FROM $1 LIMIT $BATCH); \
+		  SELECT changes();" | dbrun`
+		[ "$gone" -gt 0 ] || break
+		left=`expr $left - $gone` || left=0
+		echo "$DB: $1: $left rows left"
+	done
+	echo "DROP TABLE $1;" | dbrun
+}
+
+create()
+{
+	echo "$DB: installing new"
+	( kwebapp-sql "@SHAREDIR@/yourprog/yourprog.kwbp" ; \
+	  echo "@DB_INDEX@" ; echo "@DB_USERDIR@" ; ) | sqlite3 "$DB"
+	sqlite3 "$DB" "PRAGMA journal_mode = @DB_JOURNAL@;" >/dev/null
+	chown www "$DB"
+	chmod 600 "$DB"
+}
+
+# Apply the diff in $TMPFILE (or the online patch being resumed).
+
+patch()
+{
+	STEPS=`steps`
+	echo "$DB: patching existing"
+
+	if [ $ONLINE -eq 1 ]
+	then
+		# Each step is its own transaction, recorded with it so
+		# that a resumed patch skips it.
+
+		if [ -f "$STEPS" ]
+		then
+			echo "$DB: resuming online patch"
+		else
+			cp $TMPFILE "$STEPS.tmp"
+			mv "$STEPS.tmp" "$STEPS"
+		fi
+		echo "CREATE TABLE IF NOT EXISTS upgrade_step \
+		      (id INTEGER PRIMARY KEY);" | dbrun
+		n=`grep -c '^-- step$' "$STEPS"` || true
+		i=1
+		while [ $i -le $n ]
+		do
+			ran=`echo "SELECT count(*) FROM upgrade_step \
+			     WHERE id = $i;" | dbrun`
+			if [ $ran -eq 0 ]
+			then
+				echo "$DB: step $i of $n"
+				( echo "BEGIN IMMEDIATE TRANSACTION;" ; \
+				  awk -v n=$i \
+				    '/^-- step$/ { s++ ; next } s == n' \
+				    "$STEPS" ; \
+				  echo "INSERT INTO upgrade_step (id) \
+				        VALUES ($i);" ; \
+				  echo "COMMIT TRANSACTION;" ; ) | dbrun
+			fi
+			i=`expr $i + 1`
+		done
+		if [ -n "`echo "SELECT name FROM sqlite_master \
+		     WHERE type = 'table' AND name = 'sess_old';" | dbrun`" ]
+		then
+			purge sess_old
+		fi
+	elif grep -v '^--' $TMPFILE | grep -q '[^[:space:]]'
+	then
+		# Running workers keep using the database, so the
+		# exclusive lock is held only for the diff itself (if
+		# there is one); the index is made after.
+
+		( echo "BEGIN EXCLUSIVE TRANSACTION;" ; \
+		  cat $TMPFILE ; \
+		  echo "COMMIT TRANSACTION;" ; ) | dbrun
+	else
+		echo "$DB: schema unchanged"
+	fi
+
+	( echo "@DB_INDEX@" ; echo "@DB_USERDIR@" ; ) | dbrun
+	sqlite3 "$DB" "PRAGMA journal_mode = @DB_JOURNAL@;" >/dev/null
+}
+
+if [ ! -f "$MAIN" ]
 then
 	mkdir -p "@DATADIR@"
-	echo "@DATADIR@/yourprog.db: installing new"
-	kwebapp-sql "@SHAREDIR@/yourprog/yourprog.kwbp" | sqlite3 "@DATADIR@/yourprog.db"
-	chown www "@DATADIR@/yourprog.db"
-	chmod 600 "@DATADIR@/yourprog.db"
+	for DB in `dbs`
+	do
+		[ -f "$DB" ] || create
+	done
 	install -m 0444  "@SHAREDIR@/yourprog/yourprog.kwbp" "@DATADIR@/yourprog.kwbp"
 	chmod 555 "@CGIBIN@/yourprog"
 	exit 0
 fi
 
+# An online patch that was interrupted is resumed from its steps, as
+# the database is now between the old and new specification.
+
+for DB in `dbs`
+do
+	if [ -f "`steps`" -a $ONLINE -eq 0 ]
+	then
+		echo "`steps`: interrupted online patch: rerun with -o" 1>&2
+		exit 1
+	fi
+done
+
+# Once users have been spread over shards, they can't be spread over
+# another number of them.
+
+DB="$MAIN"
+echo "@DB_USERDIR@" | dbrun
+SPREAD=`echo "SELECT count(*) FROM userdir;" | dbrun`
+if [ $SPREAD -gt 0 ]
+then
+	for DB in `dbs` "`shard $SHARDS`"
+	do
+		if [ "$DB" = "`shard $SHARDS`" -a -f "$DB" ] || \
+		   [ "$DB" != "`shard $SHARDS`" -a ! -f "$DB" ]
+		then
+			echo "$MAIN: users are spread over other" \
+			     "than $SHARDS shards" 1>&2
+			exit 1
+		fi
+	done
+fi
+
 TMPFILE=`mktemp` || exit 1
-trap "rm -f $TMPFILE" ERR EXIT
+OLDFILE=`mktemp` || exit 1
+trap "rm -f $TMPFILE $OLDFILE" ERR EXIT
 
-echo "@DATADIR@/yourprog.db: patching existing"
+# Session tokens were integers: kwebapp-sqldiff can't change a column's
+# type, so the sessions are dropped (logging everybody out) and their
+# table made anew, then the rest is diffed as if it had been so.
+# The new table has all of the new columns, so the old specification's
+# sessions are replaced whole by the new ones, leaving kwebapp-sqldiff
+# nothing to add to them.
 
-( echo "BEGIN EXCLUSIVE TRANSACTION;" ; \
-  kwebapp-sqldiff "@DATADIR@/yourprog.kwbp"  "@SHAREDIR@/yourprog/yourprog.kwbp" ; \
-  echo "COMMIT TRANSACTION;" ; ) > $TMPFILE
+if grep -q "field token int;" "@DATADIR@/yourprog.kwbp"
+then
+	awk -v new="@SHAREDIR@/yourprog/yourprog.kwbp" '
+	    FILENAME == new {
+		if (/^struct sess /) n = 1
+		if (n) b = b $0 "\n"
+		if (n && /^};/) n = 0
+		next
+	    }
+	    /^struct sess / { s = 1; printf "%s", b }
+	    ! s { print }
+	    s && /^};/ { s = 0 }' \
+	    "@SHAREDIR@/yourprog/yourprog.kwbp" \
+	    "@DATADIR@/yourprog.kwbp" > $OLDFILE
+else
+	cp "@DATADIR@/yourprog.kwbp" $OLDFILE
+fi
+
+# Each statement begins a step (marked by a comment), except that the
+# sessions' table is replaced in one.
+# Online, the old table is put aside to be emptied later.
+
+( if grep -q "field token int;" "@DATADIR@/yourprog.kwbp" ; then \
+    echo "$MAIN: dropping sessions" 1>&2 ; \
+    echo "-- step" ; \
+    if [ $ONLINE -eq 1 ] ; then \
+      echo "ALTER TABLE sess RENAME TO sess_old;" ; \
+    else \
+      echo "DROP TABLE sess;" ; \
+    fi ; \
+    kwebapp-sql "@SHAREDIR@/yourprog/yourprog.kwbp" | \
+      sed -n '/^CREATE TABLE sess /,/^);/p' ; \
+  fi ; \
+  kwebapp-sqldiff $OLDFILE "@SHAREDIR@/yourprog/yourprog.kwbp" | \
+    awk 'NF && ! /^--/ && ! s { print "-- step" ; s = 1 } \
+         NF { print } /;[ \t]*$/ { s = 0 }' ; ) > $TMPFILE
 
 if [ $? -ne 0 ]
 then
-	echo "@DATADIR@/yourprog.db: patch aborted" 1>&2
+	echo "$MAIN: patch aborted" 1>&2
 	exit 1
 fi
 
-sqlite3 "@DATADIR@/yourprog.db" < $TMPFILE
+for DB in `dbs`
+do
+	if [ -f "$DB" ]
+	then
+		patch
+	else
+		create
+	fi
+done
+
+# The first time there are shards, the users are copied into them (which
+# may be repeated if interrupted), then the directory is made and the
+# originals removed at once.
+# Columns are named, as patched tables may have them in another order.
+# Session keys didn't name shards, so everybody is logged out.
+
+DB="$MAIN"
+if [ $SHARDS -gt 0 -a $SPREAD -eq 0 ]
+then
+	echo "$MAIN: spreading users over $SHARDS shards"
+	COLS=`echo "SELECT group_concat(name) \
+	      FROM pragma_table_info('user');" | dbrun`
+	i=0
+	while [ $i -lt $SHARDS ]
+	do
+		( echo "ATTACH '`shard $i`' AS shard;" ; \
+		  echo "INSERT OR IGNORE INTO shard.user ($COLS) \
+		        SELECT $COLS FROM user \
+		        WHERE id % $SHARDS = $i;" ; ) | dbrun
+		i=`expr $i + 1`
+	done
+	( echo "BEGIN IMMEDIATE TRANSACTION;" ; \
+	  echo "INSERT INTO userdir (userid, email) \
+	        SELECT id, email FROM user;" ; \
+	  echo "DELETE FROM sess;" ; \
+	  echo "DELETE FROM user;" ; \
+	  echo "COMMIT TRANSACTION;" ; ) | dbrun
+fi
+
 install -m 0444  "@SHAREDIR@/yourprog/yourprog.kwbp" "@DATADIR@/yourprog.kwbp"
 chmod 555 "@CGIBIN@/yourprog"
-rm -f "@DATADIR@/yourprog-upgrade.sql"
-echo "@DATADIR@/yourprog.db: patch success"
+
+# Only now, with the specification installed, may the steps go.
+
+for DB in `dbs`
+do
+	echo "DROP TABLE IF EXISTS upgrade_step;" | dbrun
+	rm -f "`steps`"
+done
+
+# A running yourprog-fcgi starts workers on the newly-installed binary
+# and retires the old ones once they've finished their requests.
+
+if [ -n "@PIDFILE@" -a -f "@PIDFILE@" ]
+then
+	echo "@PIDFILE@: reloading"
+	kill -HUP `cat "@PIDFILE@"`
+fi
+echo "$MAIN: patch success"